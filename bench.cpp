@@ -0,0 +1,289 @@
+// Micro-benchmarks of Coltext parsing and rendering.
+//
+// Usage: coltext-bench [--json] [--min-time ms] [--filter text]
+//
+// Every benchmark is run on every corpus and reports time per input
+// byte, heap allocations per call and bytes of output per call.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "coltext.hpp"
+#include "coltext_cache.hpp"
+
+/* Every heap allocation is counted. */
+static std::size_t allocations = 0;
+
+void * operator new (std::size_t size)
+{
+    ++allocations;
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void * operator new[] (std::size_t size) { return operator new(size); }
+
+// Memory of operator new above is malloc'ed, GCC can't see it once delete is inlined
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete   (void *p) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+void operator delete[] (void *p) noexcept { operator delete(p); }
+void operator delete   (void *p, std::size_t) noexcept { operator delete(p); }
+void operator delete[] (void *p, std::size_t) noexcept { operator delete(p); }
+
+namespace bench {
+
+/* Keeps results alive so calls are not optimized out. */
+static volatile std::size_t keep = 0;
+
+/* Stream buffer counting written bytes and dropping them. */
+class null_buf : public std::streambuf {
+public:
+    std::size_t written = 0;
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) ++written;
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char *, std::streamsize n) override
+    {
+        written += (std::size_t)n;
+        return n;
+    }
+};
+
+/* Sink dropping everything but the size. */
+struct null_sink {
+    static constexpr bool effects = true;
+    std::size_t size = 0;
+
+    void text(const char *, std::size_t len) { size += len; }
+    void effect(const coltext::detail::code &c)
+    {
+        char esc[20];
+        size += coltext::detail::format_code(c, esc);
+    }
+};
+
+struct corpus {
+    const char *name;
+    std::string text;
+};
+
+/* Repeats pattern up to about size bytes. */
+static std::string repeat(const std::string &pattern, std::size_t size)
+{
+    std::string str;
+    while (str.size() < size) str += pattern;
+    return str;
+}
+
+static std::vector<corpus> make_corpora(std::size_t size)
+{
+    std::string deep;
+    for (int i = 0; i < 32; ++i) deep += (i % 2) ? "#b(" : "<i>(";
+    deep += "deep text";
+    deep += std::string(32, ')');
+    deep += "\n";
+
+    std::string rgb;
+    for (int i = 0; i < 16; ++i)
+    {
+        rgb += "#rgb[" + std::to_string(i * 16) + ";" + std::to_string(255 - i * 8) + ";7](px) ";
+        rgb += "#RGB[0;" + std::to_string(i * 12) + ";200] cell ";
+    }
+
+    return {
+        {"plain", repeat("The quick brown fox jumps over the lazy dog, again and again.\n", size)},
+        {"dense_tags", repeat("#r(ab) <b>(cd) #G(ef) #bright_cyan(gh) <u>(ij) ", size)},
+        {"deep_nesting", repeat(deep, size)},
+        {"rgb_heavy", repeat(rgb, size)},
+        {"next_word", repeat("#r red #g green <b> bold #Y yellow_bg #bright_blue blue ", size)}
+    };
+}
+
+struct result {
+    std::string name;
+    std::string corpus;
+    double ns_per_byte;
+    double allocs_per_call;
+    std::size_t output_bytes;
+    std::size_t iterations;
+};
+
+/* One call of a benchmark, returns output size. */
+using call = std::function<std::size_t ()>;
+
+static result run(const char *name, const corpus &c, double min_ms, const call &f)
+{
+    using clock = std::chrono::steady_clock;
+
+    std::size_t output = f(); // Warm up
+
+    std::size_t before = allocations;
+    keep = keep + f();
+    std::size_t allocs = allocations - before;
+
+    std::size_t iterations = 0;
+    double ns = 0;
+    for (std::size_t batch = 1; ns < min_ms * 1e6; batch *= 2)
+    {
+        auto start = clock::now();
+        for (std::size_t i = 0; i < batch; ++i) keep = keep + f();
+        ns += std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        iterations += batch;
+    }
+
+    return {name, c.name, ns / ((double)iterations * (double)c.text.size()),
+            (double)allocs, output, iterations};
+}
+
+struct options {
+    bool json = false;
+    double min_ms = 100;
+    std::string filter;
+};
+
+static std::vector<result> run_all(const options &opt)
+{
+    using namespace coltext::detail;
+
+    std::vector<result> results;
+    auto add = [&](const char *name, const corpus &c, const call &f) {
+        std::string full = std::string(name) + "/" + c.name;
+        if (full.find(opt.filter) == std::string::npos) return;
+
+        results.push_back(run(name, c, opt.min_ms, f));
+        if (!opt.json)
+        {
+            const result &r = results.back();
+            std::printf("%-28s %8.3f ns/B %8.1f allocs %10zu bytes out\n",
+                        full.c_str(), r.ns_per_byte, r.allocs_per_call, r.output_bytes);
+        }
+    };
+
+    for (const corpus &c : make_corpora(64 * 1024))
+    {
+        const std::string &text = c.text;
+        std::string out;
+
+        // Scanning markup only, nothing is written
+        add("parse", c, [&] {
+            null_sink sink;
+            machine m;
+            feed(m, text.data(), text.size(), sink, true);
+            finish(m, sink, true);
+            return sink.size;
+        });
+
+        // Writing escapes into a reused string
+        add("render", c, [&] {
+            out.clear();
+            string_sink<std::string> sink{out};
+            machine m;
+            m.feed(text.data(), text.size(), sink);
+            m.finish(sink);
+            return out.size();
+        });
+
+        add("render_compact", c, [&] {
+            out.clear();
+            string_sink<std::string> sink{out};
+            machine m(true);
+            m.feed(text.data(), text.size(), sink);
+            m.finish(sink);
+            return out.size();
+        });
+
+        add("construct", c, [&] {
+            Coltext ctxt(text);
+            return ctxt.colored().size();
+        });
+
+        Coltext lhs(text.substr(0, text.size() / 2));
+        Coltext rhs(text.substr(text.size() / 2));
+        add("operator+", c, [&] {
+            Coltext ctxt = lhs + rhs;
+            return ctxt.colored().size();
+        });
+
+#ifndef COLTEXT_STATIC_LITERALS
+        add("_col", c, [&] {
+            return literals::operator"" _col(text.data(), text.size()).colored().size();
+        });
+#endif
+
+        coltext::render_cache cache(16 << 20, 1);
+        add("render_cache", c, [&] {
+            return cache.get(text).colored().size();
+        });
+
+        null_buf buf;
+        std::ostream os(&buf);
+
+        Coltext rendered(text);
+        add("operator<<", c, [&] {
+            buf.written = 0;
+            os << rendered;
+            return buf.written;
+        });
+
+        Coltext lazy(text, coltext::lazy);
+        add("operator<</lazy", c, [&] {
+            buf.written = 0;
+            os << lazy;
+            return buf.written;
+        });
+    }
+    return results;
+}
+
+static void print_json(const std::vector<result> &results)
+{
+    std::printf("{\n  \"version\": \"%s\",\n  \"results\": [\n", COLTEXT_HPP);
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const result &r = results[i];
+        std::printf("    {\"name\": \"%s\", \"corpus\": \"%s\", \"ns_per_byte\": %.4f, "
+                    "\"allocs_per_call\": %.1f, \"output_bytes\": %zu, \"iterations\": %zu}%s\n",
+                    r.name.c_str(), r.corpus.c_str(), r.ns_per_byte, r.allocs_per_call,
+                    r.output_bytes, r.iterations, i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+}
+
+} // namespace bench
+
+int main(int argc, char const *argv[])
+{
+    bench::options opt;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strcmp(argv[i], "--json")) opt.json = true;
+        else if (!std::strcmp(argv[i], "--min-time") && i + 1 < argc) opt.min_ms = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--filter") && i + 1 < argc) opt.filter = argv[++i];
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--json] [--min-time ms] [--filter text]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    auto results = bench::run_all(opt);
+    if (opt.json) bench::print_json(results);
+    return 0;
+}
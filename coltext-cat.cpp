@@ -0,0 +1,228 @@
+// coltext-cat. Prints files with Coltext markup rendered.
+//
+// Usage: coltext-cat [-m ansi|plain|auto] [-c] [--colors 24|256|16] [--stats] [file...]
+//
+// Reads stdin if no files are given or file is "-". Regular files
+// are mapped to memory, pipes are read in large blocks. Effects left
+// open are closed at the end of every file.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "coltext.hpp"
+
+namespace cat {
+
+constexpr std::size_t block_size = 1 << 20;
+
+/* Buffered output to file descriptor. Big writes skip the buffer. */
+class fd_buf : public std::streambuf {
+public:
+    explicit fd_buf(int fd)
+    : fd(fd),
+      buffer(block_size)
+    {
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+
+    ~fd_buf() override { this->sync(); }
+
+    std::size_t written = 0;
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!this->flush()) return traits_type::eof();
+        if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+
+        *this->pptr() = traits_type::to_char_type(ch);
+        this->pbump(1);
+        return ch;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        if (n <= this->epptr() - this->pptr())
+        {
+            traits_type::copy(this->pptr(), s, (std::size_t)n);
+            this->pbump((int)n);
+            return n;
+        }
+
+        if (!this->flush()) return 0;
+        if ((std::size_t)n < this->buffer.size()) return this->xsputn(s, n);
+        return this->write_all(s, (std::size_t)n) ? n : 0;
+    }
+
+    int sync() override { return this->flush() ? 0 : -1; }
+
+private:
+    bool flush()
+    {
+        std::size_t n = (std::size_t)(this->pptr() - this->pbase());
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+        return this->write_all(this->buffer.data(), n);
+    }
+
+    bool write_all(const char *s, std::size_t n)
+    {
+        while (n > 0)
+        {
+            ssize_t done = ::write(this->fd, s, n);
+            if (done < 0)
+            {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            s += done;
+            n -= (std::size_t)done;
+            this->written += (std::size_t)done;
+        }
+        return true;
+    }
+
+    int fd;
+    std::vector<char> buffer;
+};
+
+/* Writes the whole file to out, returns its size or -1 on error. */
+long long copy_file(int fd, coltext::streambuf &out, std::vector<char> &block)
+{
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        std::size_t size = (std::size_t)st.st_size;
+        void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            ::madvise(data, size, MADV_SEQUENTIAL);
+            std::streamsize done = out.sputn((const char *)data, (std::streamsize)size);
+            ::munmap(data, size);
+            return done == (std::streamsize)size ? (long long)size : -1;
+        }
+    }
+
+    // Pipes, terminals and files that can't be mapped
+    long long total = 0;
+    for (;;)
+    {
+        ssize_t n = ::read(fd, block.data(), block.size());
+        if (n == 0) return total;
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (out.sputn(block.data(), n) != n) return -1;
+        total += n;
+    }
+}
+
+int usage(const char *name)
+{
+    std::fprintf(stderr, "Usage: %s [-m ansi|plain|auto] [-c] [--colors 24|256|16] [--stats] [file...]\n"
+                         "  -m, --mode     ansi (default), plain or auto\n"
+                         "  -c, --compact  merge escapes\n"
+                         "      --colors   colors of terminal, 24 (bit, default), 256 or 16\n"
+                         "      --stats    print throughput to stderr\n", name);
+    return 2;
+}
+
+} // namespace cat
+
+int main(int argc, char const *argv[])
+{
+    coltext::render_mode mode = coltext::render_mode::ansi;
+    bool compact = false;
+    coltext::color_depth colors = coltext::color_depth::truecolor;
+    bool stats = false;
+    std::vector<const char *> files;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if ((arg == "-m" || arg == "--mode") && i + 1 < argc)
+        {
+            std::string value = argv[++i];
+            if      (value == "ansi")  mode = coltext::render_mode::ansi;
+            else if (value == "plain") mode = coltext::render_mode::plain;
+            else if (value == "auto")  mode = coltext::render_mode::automatic;
+            else return cat::usage(argv[0]);
+        }
+        else if (arg == "--colors" && i + 1 < argc)
+        {
+            std::string value = argv[++i];
+            if      (value == "24")  colors = coltext::color_depth::truecolor;
+            else if (value == "256") colors = coltext::color_depth::xterm256;
+            else if (value == "16")  colors = coltext::color_depth::ansi16;
+            else return cat::usage(argv[0]);
+        }
+        else if (arg == "-c" || arg == "--compact") compact = true;
+        else if (arg == "--stats") stats = true;
+        else if (arg == "-h" || arg == "--help") return cat::usage(argv[0]);
+        else if (arg.size() > 1 && arg[0] == '-') return cat::usage(argv[0]);
+        else files.push_back(argv[i]);
+    }
+    if (files.empty()) files.push_back("-");
+
+    // Output is not std::cout, so check the terminal here
+    if (mode == coltext::render_mode::automatic)
+    {
+        mode = coltext::detail::terminal_has_colors(STDOUT_FILENO) ?
+               coltext::render_mode::ansi : coltext::render_mode::plain;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int status = 0;
+    long long input = 0;
+
+    cat::fd_buf stdout_buf(STDOUT_FILENO);
+    std::size_t output = 0;
+    {
+        coltext::streambuf out(&stdout_buf, mode, compact, colors);
+        std::vector<char> block(cat::block_size);
+
+        for (const char *file : files)
+        {
+            bool is_stdin = std::strcmp(file, "-") == 0;
+            int fd = is_stdin ? STDIN_FILENO : ::open(file, O_RDONLY);
+            if (fd < 0)
+            {
+                std::fprintf(stderr, "%s: %s: %s\n", argv[0], file, std::strerror(errno));
+                status = 1;
+                continue;
+            }
+
+            long long size = cat::copy_file(fd, out, block);
+            if (size < 0)
+            {
+                std::fprintf(stderr, "%s: %s: %s\n", argv[0], file, std::strerror(errno));
+                status = 1;
+            }
+            else input += size;
+
+            out.finish();
+            if (!is_stdin) ::close(fd);
+        }
+
+        if (out.pubsync() != 0) status = 1;
+    }
+    output = stdout_buf.written;
+
+    if (stats)
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::fprintf(stderr, "%s: %lld bytes in, %zu bytes out, %.3f s, %.1f MB/s\n", argv[0],
+                     input, output, seconds, seconds > 0 ? (double)input / seconds / 1e6 : 0.0);
+    }
+    return status;
+}
@@ -0,0 +1,21 @@
+// Coltext compiled once.
+
+// Copyright (C) 2020 by Earl H. (1410rlH)
+//
+// Built with COLTEXT_SEPARATE_COMPILATION by coltext-compiled
+// CMake target. Other TUs then take Coltext, standard streams and
+// terminal checks from here instead of compiling them again.
+
+//
+// Distributed by the terms of GPL.
+// See LICENSE for details.
+//
+
+#define COLTEXT_SOURCE
+#include "coltext.hpp"
+
+#if defined(COLTEXT_SEPARATE_COMPILATION)
+template class basic_coltext<std::allocator<char>>;
+template std::istream & operator>> (std::istream &, Coltext &);
+template std::ostream & operator<< (std::ostream &, const Coltext &);
+#endif
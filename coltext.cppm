@@ -0,0 +1,86 @@
+// Coltext C++20 module.
+
+// Copyright (C) 2020 by Earl H. (1410rlH)
+//
+// Exports Coltext and its companion headers, so they are
+// compiled once for the program: import coltext;
+
+//
+// Distributed by the terms of GPL.
+// See LICENSE for details.
+//
+
+module;
+
+#include "coltext.hpp"
+#include "coltext_async.hpp"
+#include "coltext_batch.hpp"
+#include "coltext_cache.hpp"
+#include "coltext_spans.hpp"
+
+export module coltext;
+
+export using ::basic_coltext;
+export using ::Coltext;
+export using ::operator<<;
+export using ::operator>>;
+
+export inline namespace literals {
+    using ::literals::operator"" _col;
+}
+
+export namespace ansi {
+    using ansi::Effect;
+    using ansi::to_code;
+    using ansi::to_off;
+    using ansi::find_effect;
+}
+
+export namespace coltext {
+    using coltext::color;
+    using coltext::color_depth;
+    using coltext::lazy_t;
+    using coltext::lazy;
+    using coltext::limits;
+    using coltext::render_mode;
+
+    using coltext::set_render_mode;
+    using coltext::get_render_mode;
+    using coltext::set_compact_escapes;
+    using coltext::get_compact_escapes;
+    using coltext::set_color_depth;
+    using coltext::get_color_depth;
+    using coltext::set_limits;
+    using coltext::get_limits;
+
+    using coltext::stats;
+    using coltext::stats_hook;
+    using coltext::get_stats;
+    using coltext::set_stats_hook;
+
+    using coltext::streambuf;
+    using coltext::ostream;
+    using coltext::parser;
+    using coltext::compiled_template;
+
+#ifdef __cpp_lib_memory_resource
+    namespace pmr {
+        using coltext::pmr::Coltext;
+    }
+#endif
+
+    using coltext::async_log;
+    using coltext::async_options;
+    using coltext::overflow;
+
+    using coltext::batch_options;
+    using coltext::batch_result;
+    using coltext::render_batch;
+    using coltext::render_lines;
+
+    using coltext::render_cache;
+
+    using coltext::span;
+    using coltext::style;
+    using coltext::styled_text;
+}
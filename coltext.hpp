@@ -20,57 +20,353 @@
 #define COLTEXT_HPP "1.1.1"
 
 
-#include <iostream>
-#include <sstream>
+/* Coltext is header only. With COLTEXT_SEPARATE_COMPILATION defined
+   (coltext-compiled CMake target does it), Coltext and functions using
+   standard streams and the terminal are compiled once in coltext.cpp:
+   other TUs don't instantiate them and don't include <iostream>. */
+#if defined(COLTEXT_SEPARATE_COMPILATION)
+#define COLTEXT_INLINE
+#else
+#define COLTEXT_INLINE inline
+#endif
+
+#if !defined(COLTEXT_SEPARATE_COMPILATION) || defined(COLTEXT_SOURCE)
+#define COLTEXT_DEFINE_SYSTEM 1
+#endif
+
+#include <atomic>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <istream>
+#include <memory>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+
+#if defined(COLTEXT_DEFINE_SYSTEM)
+#include <iostream>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#endif
+
+/* Plain text is scanned with SSE2, or AVX2 if the compiler targets it 
+   (e.g. -mavx2). Define COLTEXT_NO_SIMD to use plain loops only. */
+#if !defined(COLTEXT_NO_SIMD) && \
+    (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define COLTEXT_SIMD 1
+#if defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+/* With COLTEXT_STATS defined, parsers count their work and rendering
+   is timed, see coltext::get_stats(). Otherwise counting compiles to nothing. */
+#if defined(COLTEXT_STATS)
+#include <chrono>
+#include <mutex>
+#endif
+
+/* "#text"_col is parsed at compile time when the standard library
+   allows std::string and std::vector in constant expressions. Define
+   COLTEXT_NO_STATIC_LITERALS to parse literals at run time instead, e.g.
+   when instrumentation such as -fsanitize=undefined rejects them. */
+#if !defined(COLTEXT_NO_STATIC_LITERALS) && \
+    defined(__cpp_lib_constexpr_string) && __cpp_lib_constexpr_string >= 201907L && \
+    defined(__cpp_lib_constexpr_vector) && __cpp_lib_constexpr_vector >= 201907L && \
+    defined(__cpp_lib_is_constant_evaluated) && \
+    defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+#define COLTEXT_STATIC_LITERALS 1
+#define COLTEXT_CONSTEXPR constexpr
+#else
+#define COLTEXT_CONSTEXPR
+#endif
+
+namespace coltext {
+
+/** 
+ * @enum class color_depth
+ * @brief:
+ *  Colors terminal can show. #rgb and #RGB colors are 
+ *  printed as the nearest of xterm-256 or 16 colors 
+ *  for terminals that have no 24bit colors.
+ */
+enum class color_depth : unsigned char {
+    truecolor,
+    xterm256,
+    ansi16
+};
+
+namespace detail { 
+template <class Alloc> class basic_machine; 
+struct slice_point;
+
+/* How Coltext was rendered. */
+struct render_config {
+    bool plain   = false; // Without escapes
+    bool compact = false; // With minimal escapes
+    color_depth colors = color_depth::truecolor;
+};
+
+constexpr bool operator== (const render_config &lhs, const render_config &rhs) noexcept
+{
+    return lhs.plain == rhs.plain && lhs.compact == rhs.compact && lhs.colors == rhs.colors;
+}
+
+constexpr bool operator!= (const render_config &lhs, const render_config &rhs) noexcept
+{
+    return !(lhs == rhs);
+}
+
+/* shared_ptr loaded and published by const methods of many threads.
+   Copies load it too. std::atomic<std::shared_ptr> is used where the
+   library has it, atomic shared_ptr functions otherwise. */
+template <class T>
+class atomic_shared_ptr {
+public:
+    atomic_shared_ptr() = default;
+    atomic_shared_ptr(const atomic_shared_ptr &other) noexcept : ptr(other.load()) {}
+
+    atomic_shared_ptr & operator= (const atomic_shared_ptr &other) noexcept
+    {
+        this->store(other.load());
+        return *this;
+    }
+
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::shared_ptr<T> load() const noexcept { return ptr.load(std::memory_order_acquire); }
+    void store(std::shared_ptr<T> value) noexcept { ptr.store(std::move(value), std::memory_order_release); }
+
+    /* Keeps value if nothing is kept yet, otherwise sets value to the kept one. */
+    void publish(std::shared_ptr<T> &value) noexcept
+    {
+        std::shared_ptr<T> kept;
+        if (!ptr.compare_exchange_strong(kept, value, std::memory_order_acq_rel, std::memory_order_acquire)) value = std::move(kept);
+    }
+#else
+    std::shared_ptr<T> load() const noexcept { return std::atomic_load_explicit(&ptr, std::memory_order_acquire); }
+    void store(std::shared_ptr<T> value) noexcept { std::atomic_store_explicit(&ptr, std::move(value), std::memory_order_release); }
+
+    void publish(std::shared_ptr<T> &value) noexcept
+    {
+        std::shared_ptr<T> kept;
+        if (!std::atomic_compare_exchange_strong_explicit(&ptr, &kept, value, std::memory_order_acq_rel, 
+                                                          std::memory_order_acquire)) value = std::move(kept);
+    }
+#endif
+
+    void reset() noexcept { this->store(nullptr); }
+
+private:
+#if defined(__cpp_lib_atomic_shared_ptr)
+    std::atomic<std::shared_ptr<T>> ptr;
+#else
+    std::shared_ptr<T> ptr;
+#endif
+};
+}
+
+/* Tag for Coltext constructors that delay parsing until first use. */
+struct lazy_t { explicit lazy_t() = default; };
+inline constexpr lazy_t lazy{};
+
+/**
+ * @struct limits
+ * @brief:
+ *  Bounds of work done for markup that comes from users.
+ *  Parsing is linear anyway, limits bound memory and output:
+ *      max_depth     - open effects kept, deeper tags are removed 
+ *                      and have no effect;
+ *      max_tag_size  - longer tags are left as text, 17 is the
+ *                      longest effect "#rgb[255;255;255]";
+ *      max_expansion - escape bytes written per byte of markup, 
+ *                      tags over it are removed. 0 is no limit.
+ */
+struct limits {
+    std::size_t max_depth     = 1024;
+    std::size_t max_tag_size  = 17;
+    std::size_t max_expansion = 0;
+};
+
+/**
+ * @struct stats
+ * @brief:
+ *  Work done by Coltext, counted if COLTEXT_STATS is defined
+ *  and zero otherwise. Time is taken of rendering Coltext,
+ *  operator<<, coltext::streambuf, templates, batches, 
+ *  styled_text and the async_log writer.
+ */
+struct stats {
+    std::uint64_t bytes_parsed  = 0; // Markup fed to parsers
+    std::uint64_t bytes_written = 0; // Text and escapes they wrote
+    std::uint64_t tags_resolved = 0;
+    std::uint64_t tags_unknown  = 0; // Left as text
+    std::uint64_t max_depth     = 0; // Of open effects
+    std::uint64_t allocations   = 0; // Of parser stacks and Coltext buffers
+    std::uint64_t renders       = 0; // Timed calls
+    std::uint64_t render_ns     = 0; // Their time
+
+    /* Bytes written per byte of markup. */
+    double expansion() const noexcept
+    {
+        return bytes_parsed ? (double)bytes_written / (double)bytes_parsed : 0.0;
+    }
+};
 
-#include <list>
-#include <stack>
-#include <unordered_map>
+/* Called after every timed call with the work of that call. */
+using stats_hook = void (*)(const stats &);
 
+class render_cache;
+}
 
 /** 
- * @class Coltext
+ * @class basic_coltext
  * @brief:
  *  Colored text.
  *  
  *  In order to use Coltext ANSI features 
  *  you need to convert strings to it.
+ *
+ *  Markup, rendered text and parser state are kept in memory
+ *  of Alloc, e.g. of a per-request std::pmr arena.
  */ 
-class Coltext {
+template <class Alloc = std::allocator<char>>
+class basic_coltext {
 public:
-    inline Coltext();
-    inline Coltext(const std::string &);
-    inline Coltext(const char *, size_t );
-
-    Coltext   operator+  (const Coltext &);
-    Coltext & operator+= (const Coltext &);
-
-    friend inline std::istream & operator>> (std::istream &, Coltext &);
-    friend inline std::ostream & operator<< (std::ostream &, const Coltext &);
+    using allocator_type = Alloc;
+    using string_type    = std::basic_string<char, std::char_traits<char>, Alloc>;
+
+    COLTEXT_INLINE basic_coltext();
+    COLTEXT_INLINE explicit basic_coltext(const Alloc &);
+    COLTEXT_INLINE basic_coltext(const char *, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(const char *, size_t, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(const std::string &, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(std::string_view, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(string_type &&); // Markup is moved in
+
+    /* Only keep markup. It's rendered on first use, 
+       operator<< writes it straight into stream buffer. */
+    COLTEXT_INLINE basic_coltext(const char *, coltext::lazy_t, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(const char *, size_t, coltext::lazy_t, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(std::string_view, coltext::lazy_t, const Alloc & = Alloc());
+    COLTEXT_INLINE basic_coltext(string_type &&, coltext::lazy_t);
+
+    /* Copies never keep pointers into memory of other allocator. */
+    COLTEXT_INLINE basic_coltext(const basic_coltext &);
+    COLTEXT_INLINE basic_coltext(const basic_coltext &, const Alloc &);
+    basic_coltext(basic_coltext &&) = default;
+
+    COLTEXT_INLINE basic_coltext & operator= (const basic_coltext &);
+    COLTEXT_INLINE basic_coltext & operator= (basic_coltext &&);
+
+    COLTEXT_INLINE allocator_type get_allocator() const;
+
+    /* Text with ANSI escapes. Renders lazy Coltext. */
+    COLTEXT_INLINE const string_type & colored() const;
+
+    /* Renders and frees markup, keeping only rendered text. Such Coltext
+       is printed as it is in every render mode, it's still may be
+       concatenated. Example: lines.push_back(Coltext(line).drop_source()); */
+    COLTEXT_INLINE basic_coltext &  drop_source() &;
+    COLTEXT_INLINE basic_coltext && drop_source() &&;
+
+    bool has_source() const noexcept { return this->source; }
+
+    /* Columns taken in terminal, counted while rendering. UTF-8 
+       symbols take one column, East Asian wide ones take two. */
+    COLTEXT_INLINE size_t width() const;
+
+    /* Appends spaces up to n columns. Example: table << cell.pad_to(12); */
+    COLTEXT_INLINE basic_coltext &  pad_to(size_t n) &;
+    COLTEXT_INLINE basic_coltext && pad_to(size_t n) &&;
+
+    /* Cuts text to at most n columns, effects are closed as usual. */
+    COLTEXT_INLINE basic_coltext &  truncate_to(size_t n) &;
+    COLTEXT_INLINE basic_coltext && truncate_to(size_t n) &&;
+
+    /* Text of columns [begin, begin + len) with its style set at the start
+       and reset at the end, symbols cut by the bounds are left out. It has
+       no markup, as after drop_source(), and compact escapes. The first 
+       slice indexes colored text, every slice then takes O(log n + len). */
+    COLTEXT_INLINE basic_coltext slice(size_t begin, size_t len = string_type::npos) const;
+
+    /* Only right side is parsed, left side keeps its parser state. */
+    COLTEXT_INLINE basic_coltext   operator+  (const basic_coltext &) const &;
+    COLTEXT_INLINE basic_coltext   operator+  (const basic_coltext &) &&;
+    COLTEXT_INLINE basic_coltext & operator+= (const basic_coltext &);
+
+    template <class A>
+    friend std::istream & operator>> (std::istream &, basic_coltext<A> &);
+    template <class A>
+    friend std::ostream & operator<< (std::ostream &, const basic_coltext<A> &);
+
+    friend class coltext::render_cache;
 
 private:
-    struct Token {
-        enum class Type {
-            text,
-            effect,
-            effect_stop
-        };
-
-        Type type;
-        std::string value;
-    };
-    std::list<Token> tokenize(const char *str, size_t len) const noexcept; 
-    void apply_effects (std::list<Token> &tokens) const noexcept;
+    using machine = coltext::detail::basic_machine<Alloc>;
+    using slice_points = std::vector<coltext::detail::slice_point, typename 
+                         std::allocator_traits<Alloc>::template rebind_alloc<coltext::detail::slice_point>>;
+
+    COLTEXT_INLINE void render() const;
+    COLTEXT_INLINE void render(const coltext::detail::render_config &, const coltext::limits &) const;
+    COLTEXT_INLINE void append(const char *str, size_t len, const coltext::limits &) const;
+    COLTEXT_INLINE void save(const machine &) const;
+    COLTEXT_INLINE void share_state(const basic_coltext &);
+
+    string_type str;
+
+    /* Rendering is cached on first use, so these are not safe
+       to share between threads before it. Slice index below is
+       made safely by concurrent slice() of rendered Coltext. */
+    mutable string_type colored_str;
+    mutable bool rendered = true;
+    mutable coltext::detail::render_config config;
+    bool source = true; // Whether str has markup
+
+    /* Parser state at the end of str, null if nothing is left open,
+       and size of escapes closing it at the end of colored_str. */
+    mutable std::shared_ptr<const machine> state;
+    mutable size_t closing = 0;
+
+    /* Columns of colored_str text and of its closing part. */
+    mutable size_t columns = 0;
+    mutable size_t closing_columns = 0;
+
+    /* Index of colored_str made by the first slice(), null if it's changed.
+       Taken and set atomically, as const slice() of other threads may set it. */
+    mutable coltext::detail::atomic_shared_ptr<const slice_points> points;
+};
 
+using Coltext = basic_coltext<>;
 
-    std::string str;
-    std::string colored_str;
-};
+#ifdef __cpp_lib_memory_resource
+namespace coltext { 
+namespace pmr {
+    /* Coltext allocating from std::pmr::memory_resource. */
+    using Coltext = basic_coltext<std::pmr::polymorphic_allocator<char>>;
+}
+}
+#endif
 
+#ifndef COLTEXT_STATIC_LITERALS
 inline namespace literals {
-    Coltext operator"" _col(const char *str, size_t len);
+    inline Coltext operator"" _col(const char *str, size_t len);
 };
+#endif
 
 namespace ansi {
 
@@ -169,24 +465,14 @@ inline std::string to_code(Effect e)
     return std::to_string((int)e);
 } 
 
-/* Map of opposit effects. Colors can not be canceled like this.*/
-const
-std::unordered_map<Effect, Effect> effect_off = {
-    {Effect::bold, Effect::normal_itensity}, {Effect::faint, Effect::normal_itensity},
-     
-    {Effect::underline, Effect::underline_off}, {Effect::double_underline, Effect::underline_off},
-    {Effect::framed,    Effect::framed_off},    {Effect::encircled,        Effect::framed_off},
-    
-    {Effect::italic,    Effect::italic_off}, 
-    {Effect::blink,     Effect::blink_off},
-    {Effect::reverse,   Effect::reverse_off},
-    {Effect::crossed,   Effect::crossed_off},
-    {Effect::overlined, Effect::overlined_off},
+/* Supported effect acronyms. Format: "#name:" or "#name(". 
+   Kept as a plain array so it can be searched at compile time. */
+struct EffectName {
+    std::string_view name;
+    Effect effect;
 };
 
-/* Map of supported effect acronyms. Format: "#name:" or "#name(". */
-const
-std::unordered_map<std::string, Effect> name_to_effect = {
+constexpr EffectName effect_names[] = {
 /* HTML tags used as acronyms for styles */
     {"bold",      Effect::bold},      {"<b>", Effect::bold},
     {"faint",     Effect::faint},     {"<f>", Effect::faint},
@@ -247,293 +533,2673 @@ std::unordered_map<std::string, Effect> name_to_effect = {
     {"bright_White",   Effect::bright_white_bg},   {"bW", Effect::bright_white_bg}
 };
 
-} // namespace ansi
+/* Perfect hash of effect names: first, last and 8th (or middle) 
+   symbols with the name size, mixed into 8 bits by multiplication. */
+constexpr unsigned name_hash(std::string_view name) noexcept
+{
+    std::size_t n = name.size();
+    std::uint32_t key = (std::uint32_t)(unsigned char)name[0]
+                      | (std::uint32_t)(unsigned char)name[n - 1] << 8
+                      | (std::uint32_t)(unsigned char)name[n > 7 ? 7 : n / 2] << 16
+                      | (std::uint32_t)n << 24;
+    return (std::uint32_t)(key * 0xf05f5ea5u) >> 24;
+}
 
+/* Index in effect_names for every name_hash value, 0xff if none. */
+struct NameSlots {
+    unsigned char index[256];
+};
 
-inline Coltext::Coltext() 
-: str(""),
-  colored_str("")
-{};
+constexpr NameSlots make_name_slots() noexcept
+{
+    NameSlots slots{};
+    for (auto &i : slots.index) i = 0xff;
 
-inline Coltext::Coltext(const std::string &str) 
-: Coltext::Coltext(str.c_str(), str.size())
-{};
+    constexpr std::size_t size = sizeof(effect_names) / sizeof(effect_names[0]);
+    for (std::size_t i = 0; i < size; ++i)
+        slots.index[name_hash(effect_names[i].name)] = (unsigned char)i;
+    return slots;
+}
+
+inline constexpr NameSlots name_slots = make_name_slots();
 
-inline Coltext::Coltext(const char *str, size_t len)
+constexpr bool name_hash_is_perfect() noexcept
 {
-    this->str = std::string(str, len);
-    auto tokens = this->tokenize(str, len);
-    this->apply_effects(tokens);
+    constexpr std::size_t size = sizeof(effect_names) / sizeof(effect_names[0]);
+    for (std::size_t i = 0; i < size; ++i)
+        if (name_slots.index[name_hash(effect_names[i].name)] != i) return false;
+    return true;
+}
+
+static_assert(name_hash_is_perfect(), "Effect names collide in name_hash");
+
+/* Effect of a supported acronym, found without allocations. */
+constexpr bool find_effect(std::string_view name, Effect &e) noexcept
+{
+    if (name.empty()) return false;
 
-    std::stringstream ss;
-    for (const auto &tkn : tokens) ss << tkn.value;
-    this->colored_str = ss.str();
+    unsigned char i = name_slots.index[name_hash(name)];
+    if (i == 0xff || effect_names[i].name != name) return false;
+
+    e = effect_names[i].effect;
+    return true;
 }
 
-Coltext Coltext::operator+ (const Coltext &rhs)
+/* Effect turning e off. Colors can not be canceled like this. */
+constexpr Effect to_off(Effect e) noexcept
 {
-    return Coltext(this->str + rhs.str);
+    switch (e) {
+    case Effect::bold:
+    case Effect::faint:            return Effect::normal_itensity;
+    case Effect::underline:
+    case Effect::double_underline: return Effect::underline_off;
+    case Effect::framed:
+    case Effect::encircled:        return Effect::framed_off;
+    case Effect::italic:           return Effect::italic_off;
+    case Effect::blink:            return Effect::blink_off;
+    case Effect::reverse:          return Effect::reverse_off;
+    case Effect::crossed:          return Effect::crossed_off;
+    case Effect::overlined:        return Effect::overlined_off;
+    default:                       return e;
+    }
 }
 
-Coltext & Coltext::operator+= (const Coltext &rhs)
+/* Few chars of an escape sequence stored in place. */
+struct Chars {
+    char data[7];
+    unsigned char size;
+
+    constexpr std::string_view view() const noexcept 
+    {
+        return std::string_view(data, size);
+    }
+};
+
+constexpr Chars make_decimal(unsigned v) noexcept
 {
-    return *this = *this + rhs;
+    Chars c{};
+    char digits[3] = {};
+    std::size_t n = 0;
+    do { digits[n++] = char('0' + v % 10); v /= 10; } while (v != 0);
+    while (n > 0) c.data[c.size++] = digits[--n];
+    return c;
 }
 
-inline std::istream & operator>> (std::istream &is, Coltext &ctxt)
+/* "\033[<code>m" for every SGR code up to bright_white_bg
+   and decimal strings of [0, 255] for rgb colors. */
+struct EscapeTable {
+    Chars escape[(int)Effect::bright_white_bg + 1];
+    Chars decimal[256];
+};
+
+constexpr EscapeTable make_escape_table() noexcept
 {
-    std::string str; std::getline(is, str);
+    EscapeTable table{};
+    for (unsigned v = 0; v < 256; ++v) table.decimal[v] = make_decimal(v);
 
-    ctxt = Coltext(str);
-    
-    return is;
+    unsigned code = 0;
+    for (auto &esc : table.escape)
+    {
+        esc.data[esc.size++] = '\033';
+        esc.data[esc.size++] = '[';
+        for (char c : table.decimal[code++].view()) esc.data[esc.size++] = c;
+        esc.data[esc.size++] = 'm';
+    }
+    return table;
 }
 
-inline std::ostream & operator<< (std::ostream &os, const Coltext &ctxt)
+inline constexpr EscapeTable escape_table = make_escape_table();
+
+/* Ready to print escape sequence of the effect. */
+constexpr std::string_view escape(Effect e) noexcept
 {
-    return os << ctxt.colored_str;
+    return escape_table.escape[(int)e].view();
 }
 
-Coltext literals::operator"" _col(const char *str, size_t len)
+constexpr bool is_rgb(Effect e) noexcept
 {
-    return Coltext(str, len);
+    return e == Effect::rgb_fg || e == Effect::rgb_bg;
 }
 
-std::list<Coltext::Token> 
-Coltext::tokenize (const char *str, size_t len) const noexcept
+constexpr bool is_fg(Effect e) noexcept
 {
-    std::list<Token> tokens;
-    
-    int num_wait_closing = 0;
-    bool wait_next_word = false;
+    return (e == Effect::rgb_fg) ||
+           (e >= Effect::black_fg && e <= Effect::white_fg) ||
+           (e >= Effect::bright_black_fg && e <= Effect::bright_white_fg);
+}
 
-    /* Function for this scope only to check
-       whether it's symbols we can escape */
-    auto is_escapable = [](char c)->bool {
-        switch (c) {
-        default: 
-            return false;
-
-        case '#':
-        case '<':
-        case '(':
-        case ')':
-            return true;
-        };
+constexpr bool is_bg(Effect e) noexcept
+{
+    return (e == Effect::rgb_bg) ||
+           (e >= Effect::black_bg && e <= Effect::white_bg) ||
+           (e >= Effect::bright_black_bg && e <= Effect::bright_white_bg);
+}
+
+} // namespace ansi
+
+
+namespace coltext {
+
+/** 
+ * @struct color
+ * @brief:
+ *  Effect with its color. Colors of style are fg or bg effects,
+ *  default_fg or default_bg, or rgb_fg and rgb_bg with r, g, b.
+ *  Indexed rgb color is xterm-256 color r.
+ */
+struct color {
+    ansi::Effect effect = ansi::Effect::reset;
+    unsigned char r = 0, g = 0, b = 0;
+    bool indexed = false;
+};
+
+constexpr bool operator== (const color &lhs, const color &rhs) noexcept
+{
+    return lhs.effect == rhs.effect && (!ansi::is_rgb(lhs.effect) || 
+           (lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b && lhs.indexed == rhs.indexed));
+}
+
+constexpr bool operator!= (const color &lhs, const color &rhs) noexcept
+{
+    return !(lhs == rhs);
+}
+
+namespace detail {
+
+/* Longest tag that can still be an effect: 
+   "#double_underline" or "#rgb[255;255;255]". */
+constexpr std::size_t max_tag_size = 17;
+
+/* Effect resolved from a tag, any effect and not only colors. */
+using code = coltext::color;
+
+/* Writes "\033[<code>m" into buf (20 chars is enough). Returns its length. */
+constexpr std::size_t format_code(const code &c, char *buf) noexcept
+{
+    std::size_t len = 0;
+    auto put = [buf, &len](std::string_view chars) {
+        for (char ch : chars) buf[len++] = ch;
     };
 
-    std::string buffer = "";
-    for (size_t i = 0; i < len; ++i)
+    if (!ansi::is_rgb(c.effect))
     {
-        char c = str[i];
-        if ((!is_escapable(c) && c != '\\' && c != ' ') || 
-             c == '(' ||
-            (c == ' ' && !wait_next_word) ||
-            (c == ')' && num_wait_closing == 0))
-        {// Some magic cases to get plain text
-            buffer.push_back(c);
-            continue;
+        put(ansi::escape(c.effect));
+        return len;
+    }
+
+    const auto &decimal = ansi::escape_table.decimal;
+    if (c.indexed)
+    {
+        put(c.effect == ansi::Effect::rgb_fg ? "\033[38;5;" : "\033[48;5;");
+        put(decimal[c.r].view()); put("m");
+        return len;
+    }
+
+    put(c.effect == ansi::Effect::rgb_fg ? "\033[38;2;" : "\033[48;2;");
+    put(decimal[c.r].view()); put(";");
+    put(decimal[c.g].view()); put(";");
+    put(decimal[c.b].view()); put("m");
+    return len;
+}
+
+/* Parses "r;g;b" where each of r, g and b is a number in [0, 255]. */
+constexpr bool parse_rgb(std::string_view rgb, code &c) noexcept
+{
+    unsigned value[3] = {};
+    std::size_t n = 0, digits = 0;
+    for (char ch : rgb)
+    {
+        if (ch == ';')
+        {
+            if (digits == 0 || ++n == 3) return false;
+            digits = 0;
         }
-        
-        if (c == '\\' && i + 1 < len && is_escapable(str[i+1]))
-        {// Put escaped symbols without slash
-            buffer.push_back(str[++i]);
-            continue;
+        else if ('0' <= ch && ch <= '9')
+        {
+            if (++digits > 3) return false;
+            value[n] = value[n] * 10 + unsigned(ch - '0');
         }
+        else return false;
+    }
 
-        if (buffer.size() > 0)
-        {// Don't flush empty strings
-            tokens.push_back({
-                Token::Type::text, 
-                std::move(buffer)
-            });
-            buffer.clear();
-        }
+    if (n != 2 || digits == 0) return false;
+    if (value[0] > 255 || value[1] > 255 || value[2] > 255) return false;
 
-        if (c == '#' || c == '<')
-        {// Coltext tags found
-            do { buffer.push_back(str[i]); ++i; }
-            while (
-                i < len && 
-                str[i] != '('  && 
-                str[i] != ' ' 
-            ); // Get the whole tag
+    c.r = (unsigned char)value[0];
+    c.g = (unsigned char)value[1];
+    c.b = (unsigned char)value[2];
+    return true;
+}
 
-            if (i < len && str[i] == ' ')
-            {
-                buffer.push_back(' ');
-                wait_next_word = true;
-            }
-            else buffer.push_back('(');
+/* Resolves tag (without trailing ' ' or '(') to its effect. */
+constexpr bool resolve(std::string_view tag, code &c) noexcept
+{
+    if (!tag.empty() && tag[0] == '#') tag.remove_prefix(1);
 
-            tokens.push_back({ 
-                Token::Type::effect, 
-                std::move(buffer)
-            });
-            buffer.clear();
+    if (tag.size() >= 10 && tag[3] == '[' && tag.back() == ']')
+    {// If has [] sequence and enough symbols
+        std::string_view prefix = tag.substr(0, 3);
+        if      (prefix == "rgb") c.effect = ansi::Effect::rgb_fg;
+        else if (prefix == "RGB") c.effect = ansi::Effect::rgb_bg;
+        else return false;
 
-            ++num_wait_closing;
-            continue;
-        }
-        else
-        {
-            --num_wait_closing;
+        // Get from '[' to ']' exclusive 
+        return parse_rgb(tag.substr(4, tag.size() - 5), c);
+    }
 
-            tokens.push_back({ 
-                Token::Type::effect_stop, 
-                ")"
-            });
+    if (!ansi::find_effect(tag, c.effect)) return false;
 
-            if (wait_next_word && c == ' ')
-            {
-                wait_next_word = false;
-                buffer.push_back(' ');
-            }
+    // #rgb and #RGB are effects only with color given
+    return !ansi::is_rgb(c.effect);
+}
 
-            continue;
-        }
+/* Levels of xterm-256 color cube. */
+constexpr unsigned char cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+/* Colors of 16 color terminals, as xterm shows them. */
+constexpr unsigned char ansi16_colors[16][3] = {
+    {  0,   0,   0}, {205,   0,   0}, {  0, 205,   0}, {205, 205,   0},
+    {  0,   0, 238}, {205,   0, 205}, {  0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255,   0,   0}, {  0, 255,   0}, {255, 255,   0},
+    { 92,  92, 255}, {255,   0, 255}, {  0, 255, 255}, {255, 255, 255}
+};
+
+/**
+ * @struct palette_table
+ * @brief:
+ *  Lookup tables making rgb to xterm-256 colors constant time:
+ *      level - nearest cube level for every channel value;
+ *      gray  - nearest of 24 grays (232-255) for every gray value.
+ */
+struct palette_table {
+    unsigned char level[256];
+    unsigned char gray[256];
+};
+
+/* RGB of xterm-256 color. */
+constexpr void xterm_rgb(unsigned i, unsigned rgb[3]) noexcept
+{
+    if (i < 16)
+    {
+        for (int k = 0; k < 3; ++k) rgb[k] = ansi16_colors[i][k];
     }
+    else
+    if (i < 232)
+    {
+        i -= 16;
+        rgb[0] = cube_levels[i / 36];
+        rgb[1] = cube_levels[i / 6 % 6];
+        rgb[2] = cube_levels[i % 6];
+    }
+    else rgb[0] = rgb[1] = rgb[2] = 8 + 10 * (i - 232);
+}
 
-    if (buffer.size() != 0)
-    {// Flush left text
-        tokens.push_back({ 
-            Token::Type::text, 
-            std::move(buffer)
-        });
+constexpr unsigned distance(const unsigned lhs[3], const unsigned rhs[3]) noexcept
+{
+    unsigned d = 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        unsigned diff = lhs[k] > rhs[k] ? lhs[k] - rhs[k] : rhs[k] - lhs[k];
+        d += diff * diff;
     }
-    
-    for (; num_wait_closing > 0; --num_wait_closing)
-    {// Silently close open effects
-        tokens.push_back({ 
-            Token::Type::effect_stop, 
-            ")"
-        });
+    return d;
+}
+
+constexpr palette_table make_palette_table() noexcept
+{
+    palette_table table{};
+    for (unsigned v = 0; v < 256; ++v)
+    {
+        unsigned char level = 0;
+        for (unsigned char l = 1; l < 6; ++l)
+        {
+            if ((v > cube_levels[l] ? v - cube_levels[l] : cube_levels[l] - v) <
+                (v > cube_levels[level] ? v - cube_levels[level] : cube_levels[level] - v)) level = l;
+        }
+        table.level[v] = level;
+
+        unsigned gray = v < 8 ? 0 : (v - 3) / 10;
+        table.gray[v] = (unsigned char)(gray > 23 ? 23 : gray);
     }
+    return table;
+}
+
+inline constexpr palette_table palette = make_palette_table();
+
+/* Nearest xterm-256 color of the cube or grays. */
+constexpr unsigned char to_xterm256(unsigned char r, unsigned char g, unsigned char b) noexcept
+{
+    const unsigned color[3] = {r, g, b};
+
+    unsigned cube = 16 + 36u * palette.level[r] + 6u * palette.level[g] + palette.level[b];
+    unsigned gray = 232 + palette.gray[(r + g + b) / 3];
 
-    return tokens;
+    unsigned cube_rgb[3] = {}, gray_rgb[3] = {};
+    xterm_rgb(cube, cube_rgb);
+    xterm_rgb(gray, gray_rgb);
+    return (unsigned char)(distance(color, gray_rgb) < distance(color, cube_rgb) ? gray : cube);
 }
 
-void
-Coltext::apply_effects (std::list<Coltext::Token> &tokens) const noexcept
+/**
+ * @struct ansi16_table
+ * @brief:
+ *  Lookup table of 16 colors that may be the nearest to rgb of
+ *  each 32x32x32 cell: those not farther from the whole cell than
+ *  some other color is from its farthest point. 16 colors are 
+ *  scattered unevenly, so a cell can't keep just one of them,
+ *  but it keeps 2.5 of them on average and 6 at most.
+ */
+struct ansi16_table {
+    std::uint16_t candidates[8][8][8]; // Bit i is color i
+};
+
+constexpr ansi16_table make_ansi16_table() noexcept
 {
-    using namespace ansi;
+    ansi16_table table{};
+    for (unsigned cell = 0; cell < 512; ++cell)
+    {
+        const unsigned low[3] = {cell / 64 * 32, cell / 8 % 8 * 32, cell % 8 * 32};
+
+        unsigned nearest[16] = {}, farthest[16] = {}, bound = ~0u;
+        for (unsigned i = 0; i < 16; ++i)
+        {
+            unsigned rgb[3] = {}, in[3] = {}, far[3] = {};
+            xterm_rgb(i, rgb);
+            for (int k = 0; k < 3; ++k)
+            {
+                in[k]  = rgb[k] < low[k] ? low[k] : rgb[k] > low[k] + 31 ? low[k] + 31 : rgb[k];
+                far[k] = rgb[k] < low[k] + 16 ? low[k] + 31 : low[k];
+            }
+            nearest[i]  = distance(in, rgb);
+            farthest[i] = distance(far, rgb);
+            if (farthest[i] < bound) bound = farthest[i];
+        }
 
-    std::stack<Effect> effects;
+        std::uint16_t mask = 0;
+        for (unsigned i = 0; i < 16; ++i)
+        {
+            if (nearest[i] <= bound) mask |= (std::uint16_t)(1u << i);
+        }
+        table.candidates[cell / 64][cell / 8 % 8][cell % 8] = mask;
+    }
+    return table;
+}
 
-    std::stack<std::string> last_bg({to_code(Effect::default_bg)});
-    std::stack<std::string> last_fg({to_code(Effect::default_fg)});
+inline constexpr ansi16_table ansi16_cells = make_ansi16_table();
 
-    bool ignore_stop = false;
+/* Nearest of 16 colors, the first one of equally near. Only colors
+   kept for the cell of rgb are checked: going through xterm-256
+   instead gives a wrong one for about a fifth of colors. */
+constexpr unsigned char to_ansi16(unsigned char r, unsigned char g, unsigned char b) noexcept
+{
+    const unsigned color[3] = {r, g, b};
 
-    auto tkn = tokens.begin();
-    while (tkn != tokens.end())
+    unsigned best = 0, best_distance = ~0u;
+    unsigned mask = ansi16_cells.candidates[r >> 5][g >> 5][b >> 5];
+    for (unsigned i = 0; mask; ++i, mask >>= 1)
     {
-        if (tkn->type == Token::Type::text) { ++tkn; continue; }
-        
-        Effect e; std::string effect_code;
-        if (tkn->type == Token::Type::effect)
+        if (!(mask & 1)) continue;
+
+        unsigned rgb[3] = {};
+        xterm_rgb(i, rgb);
+        if (distance(color, rgb) < best_distance)
         {
-            std::string name = tkn->value;
+            best = i;
+            best_distance = distance(color, rgb);
+        }
+    }
+    return (unsigned char)best;
+}
 
-            name.pop_back(); // Delete ' ' or '('
-            if (name.at(0) == '#') name.erase(0, 1);
+/* rgb color as terminal with the given colors shows it. */
+constexpr code downsample(const code &c, color_depth colors) noexcept
+{
+    if (!ansi::is_rgb(c.effect) || c.indexed || colors == color_depth::truecolor) return c;
 
-            std::string rgb;
-            if (name.size() >= 10 && 
-                name[3] == '[' && name.back() == ']')  
-            {// If has [] sequence and enough symbols
-                std::string prefix = name.substr(0, 3);
-                if (prefix == "rgb" || prefix == "RGB")
-                {
-                    // Get from '[' to ']' exclusive 
-                    rgb = name.substr(4, name.size() - 5); 
-
-                    bool valid = true;
-                    for (const auto &c : rgb)
-                    {
-                        if (!('0' <= c && c <= '9') && c != ';')
-                        {
-                            valid = false;
-                            break;
-                        }
-                    }
-
-                    if (valid) name = prefix;
-                }
-            }
+    if (colors == color_depth::xterm256) return code{c.effect, to_xterm256(c.r, c.g, c.b), 0, 0, true};
 
-            auto it = ansi::name_to_effect.find(name);
-            if (it == ansi::name_to_effect.end())
-            {
-            /* If it's not a valid effect, 
-                we just leave it as text */
-                tkn->type = Token::Type::text;
-                ignore_stop = true; 
-                ++tkn; continue;
-            }
-            else e = it->second;
+    using ansi::Effect;
+    unsigned color = to_ansi16(c.r, c.g, c.b);
+    bool fg = c.effect == Effect::rgb_fg;
+    if (color < 8) return code{(Effect)((unsigned)(fg ? Effect::black_fg : Effect::black_bg) + color)};
+    return code{(Effect)((unsigned)(fg ? Effect::bright_black_fg : Effect::bright_black_bg) + color - 8)};
+}
+
+} // namespace detail
 
-            tkn->value = name;
+/**
+ * @struct style
+ * @brief:
+ *  Text style of terminal, as SGR codes set it.
+ *  Lets compact output drop escapes that change nothing,
+ *  and is given to backends of style spans.
+ */
+struct style {
+    enum : std::uint8_t {
+        bold      = 1,
+        faint     = 2,
+        italic    = 4,
+        blink     = 8,
+        reverse   = 16,
+        crossed   = 32,
+        overlined = 64
+    };
 
-            effects.push(e);
-            effect_code = to_code(e);
-            if (e == Effect::rgb_bg || e == Effect::rgb_fg)
-                effect_code += ";2;" + rgb;
-            
+    std::uint8_t attrs     = 0;
+    std::uint8_t underline = 0; // 1 for single, 2 for double
+    std::uint8_t frame     = 0; // 1 for framed, 2 for encircled
 
-            if ((e == Effect::rgb_bg) ||
-                (e >= Effect::black_bg && e <= Effect::white_bg) ||
-                (e >= Effect::bright_black_bg && e <= Effect::bright_white_bg))
-            {
-                last_bg.push(effect_code);
-            }
-            else
-            if ((e == Effect::rgb_fg) ||
-                (e >= Effect::black_fg && e <= Effect::white_fg) ||
-                (e >= Effect::bright_black_fg && e <= Effect::bright_white_fg))
-            {
-                last_fg.push(effect_code);
-            }
+    color fg{ansi::Effect::default_fg};
+    color bg{ansi::Effect::default_bg};
+
+    constexpr void apply(const color &c) noexcept
+    {
+        using ansi::Effect;
+
+        switch (c.effect) {
+        case Effect::reset:     *this = style(); break;
+
+        case Effect::bold:      attrs |= bold;      break;
+        case Effect::faint:     attrs |= faint;     break;
+        case Effect::italic:    attrs |= italic;    break;
+        case Effect::blink:     attrs |= blink;     break;
+        case Effect::reverse:   attrs |= reverse;   break;
+        case Effect::crossed:   attrs |= crossed;   break;
+        case Effect::overlined: attrs |= overlined; break;
+
+        case Effect::normal_itensity: attrs &= (std::uint8_t)~(bold | faint); break;
+        case Effect::italic_off:      attrs &= (std::uint8_t)~italic;    break;
+        case Effect::blink_off:       attrs &= (std::uint8_t)~blink;     break;
+        case Effect::reverse_off:     attrs &= (std::uint8_t)~reverse;   break;
+        case Effect::crossed_off:     attrs &= (std::uint8_t)~crossed;   break;
+        case Effect::overlined_off:   attrs &= (std::uint8_t)~overlined; break;
+
+        case Effect::underline:        underline = 1; break;
+        case Effect::double_underline: underline = 2; break;
+        case Effect::underline_off:    underline = 0; break;
+
+        case Effect::framed:     frame = 1; break;
+        case Effect::encircled:  frame = 2; break;
+        case Effect::framed_off: frame = 0; break;
+
+        default:
+            if      (ansi::is_fg(c.effect) || c.effect == Effect::default_fg) fg = c;
+            else if (ansi::is_bg(c.effect) || c.effect == Effect::default_bg) bg = c;
         }
-        else 
-        if (tkn->type == Token::Type::effect_stop)
+    }
+};
+
+constexpr bool operator== (const style &lhs, const style &rhs) noexcept
+{
+    return lhs.attrs == rhs.attrs && lhs.underline == rhs.underline &&
+           lhs.frame == rhs.frame && lhs.fg == rhs.fg && lhs.bg == rhs.bg;
+}
+
+constexpr bool operator!= (const style &lhs, const style &rhs) noexcept
+{
+    return !(lhs == rhs);
+}
+
+namespace detail {
+
+using coltext::style;
+
+/* Writes SGR codes turning style `from` into `to`, separated by ';'.
+   buf must hold 80 chars. Returns written size. */
+constexpr std::size_t style_codes(const style &from, const style &to, char *buf) noexcept
+{
+    using ansi::Effect;
+
+    std::size_t len = 0;
+    auto put = [buf, &len](std::string_view chars) {
+        if (len > 0) buf[len++] = ';';
+        for (char ch : chars) buf[len++] = ch;
+    };
+    auto put_effect = [&put](Effect e) {
+        put(ansi::escape_table.decimal[(int)e].view());
+    };
+    auto put_color = [&put, &put_effect](const code &c) {
+        put_effect(c.effect);
+        if (!ansi::is_rgb(c.effect)) return;
+
+        if (c.indexed)
         {
-            if (ignore_stop)
-            {
-                tokens.erase(tkn++);
-                ignore_stop = false;
-                continue;
-            }
+            put("5");
+            put(ansi::escape_table.decimal[c.r].view());
+            return;
+        }
 
-            e = effects.top();
-            effects.pop();
-            
-            if ((e == Effect::rgb_bg) ||
-                (e >= Effect::black_bg && e <= Effect::white_bg) ||
-                (e >= Effect::bright_black_bg && e <= Effect::bright_white_bg))
-            {
-                last_bg.pop();
-                effect_code = last_bg.top();
-            }
-            else
-            if ((e == Effect::rgb_fg) ||
-                (e >= Effect::black_fg && e <= Effect::white_fg) ||
-                (e >= Effect::bright_black_fg && e <= Effect::bright_white_fg))
-            {
-                last_fg.pop();
-                effect_code = last_fg.top();
-            } 
-            else
-            {
-                e = effect_off.at(e);
-                effect_code = to_code(e);
-            }
+        put("2");
+        put(ansi::escape_table.decimal[c.r].view());
+        put(ansi::escape_table.decimal[c.g].view());
+        put(ansi::escape_table.decimal[c.b].view());
+    };
+
+    struct Flag { std::uint8_t bit; Effect on, off; };
+    constexpr Flag flags[] = {
+        {style::bold,      Effect::bold,      Effect::normal_itensity},
+        {style::faint,     Effect::faint,     Effect::normal_itensity},
+        {style::italic,    Effect::italic,    Effect::italic_off},
+        {style::blink,     Effect::blink,     Effect::blink_off},
+        {style::reverse,   Effect::reverse,   Effect::reverse_off},
+        {style::crossed,   Effect::crossed,   Effect::crossed_off},
+        {style::overlined, Effect::overlined, Effect::overlined_off}
+    };
+
+    std::uint8_t attrs = from.attrs;
+    for (const auto &f : flags)
+    {// Turn off first, bold and faint are turned off together
+        if ((attrs & f.bit) && !(to.attrs & f.bit))
+        {
+            put_effect(f.off);
+            if (f.off == Effect::normal_itensity) attrs &= (std::uint8_t)~(style::bold | style::faint);
+            else attrs &= (std::uint8_t)~f.bit;
         }
+    }
+    for (const auto &f : flags)
+    {
+        if (!(attrs & f.bit) && (to.attrs & f.bit)) put_effect(f.on);
+    }
+
+    if (from.underline != to.underline)
+    {
+        put_effect(to.underline == 0 ? Effect::underline_off :
+                   to.underline == 1 ? Effect::underline : Effect::double_underline);
+    }
+    if (from.frame != to.frame)
+    {
+        put_effect(to.frame == 0 ? Effect::framed_off :
+                   to.frame == 1 ? Effect::framed : Effect::encircled);
+    }
+
+    if (from.fg != to.fg) put_color(to.fg);
+    if (from.bg != to.bg) put_color(to.bg);
+    return len;
+}
+
+/* Writes a single escape turning style `from` into `to`:
+   either the difference or reset with `to` set from scratch.
+   Returns its size. */
+template <class Sink>
+COLTEXT_CONSTEXPR std::size_t write_style(const style &from, const style &to, Sink &out)
+{
+    char diff[84]  = {'\033', '['};
+    char reset[84] = {'\033', '[', '0'};
+
+    std::size_t diff_size = 2 + style_codes(from, to, diff + 2);
+
+    std::size_t reset_size = 3;
+    if (std::size_t n = style_codes(style(), to, reset + 4)) 
+    {
+        reset[3] = ';';
+        reset_size = 4 + n;
+    }
 
-        // Create ANSI escape code from effect code
-        tkn->value = "\033[" + effect_code + "m";
-        ++tkn; continue;
+    if (reset_size < diff_size)
+    {
+        reset[reset_size++] = 'm';
+        out.text(reset, reset_size);
+        return reset_size;
     }
+
+    diff[diff_size++] = 'm';
+    out.text(diff, diff_size);
+    return diff_size;
 }
 
+/* Whether Sink takes styles of compact machine instead of escapes. */
+template <class Sink, class = void>
+struct takes_styles : std::false_type {};
+
+template <class Sink>
+struct takes_styles<Sink, std::void_t<decltype(Sink::styles)>> : std::bool_constant<Sink::styles> {};
+
+/* Position of the first markup symbol in str[0, len): '#', '<', '\\',
+   also ')' if effects wait closing and ' ' if they wait next word. */
+constexpr std::size_t scan_scalar(const char *str, std::size_t len, bool close, bool space) noexcept
+{
+    std::size_t i = 0;
+    for (; i < len; ++i)
+    {
+        char c = str[i];
+        if (c == '#' || c == '<' || c == '\\' ||
+            (close && c == ')') || (space && c == ' ')) break;
+    }
+    return i;
+}
+
+#ifdef COLTEXT_SIMD
+
+inline unsigned first_bit(unsigned mask) noexcept
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long i;
+    _BitScanForward(&i, mask);
+    return (unsigned)i;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+
+/* Compares whole blocks of text with every markup symbol.
+   Symbols that are not markup now are replaced by '#'. */
+inline std::size_t scan_simd(const char *str, std::size_t len, bool close, bool space) noexcept
+{
+    const char closing = close ? ')' : '#';
+    const char next    = space ? ' ' : '#';
+    std::size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i hash32  = _mm256_set1_epi8('#');
+    const __m256i angle32 = _mm256_set1_epi8('<');
+    const __m256i slash32 = _mm256_set1_epi8('\\');
+    const __m256i close32 = _mm256_set1_epi8(closing);
+    const __m256i space32 = _mm256_set1_epi8(next);
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(str + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, hash32), _mm256_cmpeq_epi8(v, angle32)),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, slash32),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, close32), _mm256_cmpeq_epi8(v, space32))));
+
+        unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + first_bit(mask);
+    }
+#endif
+
+    const __m128i hash16  = _mm_set1_epi8('#');
+    const __m128i angle16 = _mm_set1_epi8('<');
+    const __m128i slash16 = _mm_set1_epi8('\\');
+    const __m128i close16 = _mm_set1_epi8(closing);
+    const __m128i space16 = _mm_set1_epi8(next);
+
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, hash16), _mm_cmpeq_epi8(v, angle16)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, slash16),
+                _mm_or_si128(_mm_cmpeq_epi8(v, close16), _mm_cmpeq_epi8(v, space16))));
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(m);
+        if (mask) return i + first_bit(mask);
+    }
+
+    return i + scan_scalar(str + i, len - i, close, space);
+}
+
+#endif // COLTEXT_SIMD
+
+inline COLTEXT_CONSTEXPR std::size_t scan(const char *str, std::size_t len, bool close, bool space) noexcept
+{
+#ifdef COLTEXT_SIMD
+#ifdef COLTEXT_STATIC_LITERALS
+    if (std::is_constant_evaluated()) return scan_scalar(str, len, close, space);
+#endif
+    return scan_simd(str, len, close, space);
+#else
+    return scan_scalar(str, len, close, space);
+#endif
+}
+
+/* Range of code points [first, last]. */
+struct code_range {
+    char32_t first, last;
+};
+
+/* Combining marks and format symbols taking no column. */
+constexpr code_range zero_width[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902}, {0x093A, 0x093A},
+    {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+    {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+    {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+    {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+    {0xE0100, 0xE01EF}
+};
+
+/* East Asian Wide and Fullwidth symbols and emoji, taking two columns. */
+constexpr code_range double_width[] = {
+    {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+    {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+    {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+    {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+    {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+    {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+    {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+    {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+    {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+    {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+    {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+    {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B},
+    {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F7E0, 0x1F7EB}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+    {0x30000, 0x3FFFD}
+};
+
+template <std::size_t N>
+constexpr bool in_ranges(const code_range (&ranges)[N], char32_t cp) noexcept
+{
+    if (cp < ranges[0].first || cp > ranges[N - 1].last) return false;
+
+    std::size_t lo = 0, hi = N;
+    while (lo < hi)
+    {
+        std::size_t mid = (lo + hi) / 2;
+        if      (cp > ranges[mid].last)  lo = mid + 1;
+        else if (cp < ranges[mid].first) hi = mid;
+        else return true;
+    }
+    return false;
+}
+
+/* Columns taken by a code point in terminal. Control symbols take none. */
+constexpr std::size_t char_width(char32_t cp) noexcept
+{
+    if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) return 0;
+    if (cp < 0x300) return 1;
+    if (in_ranges(zero_width, cp))   return 0;
+    if (in_ranges(double_width, cp)) return 2;
+    return 1;
+}
+
+/**
+ * @struct text_width
+ * @brief:
+ *  Columns of UTF-8 text taken in terminal. Text may come in 
+ *  chunks split inside of a symbol. Broken sequences take one 
+ *  column per byte, like replacement symbols do.
+ */
+struct text_width {
+    std::size_t columns = 0;
+    char32_t    cp      = 0; // Code point being decoded
+    std::uint8_t left   = 0; // Its continuation bytes left
+
+    COLTEXT_CONSTEXPR void add(const char *str, std::size_t len) noexcept
+    {
+        std::size_t n = columns;
+        for (std::size_t i = 0, slow = 0; i < len; )
+        {
+            if (left == 0 && i >= slow && len - i >= 32)
+            {// Blocks of ASCII at once
+                unsigned high = 0, control = 0;
+                for (std::size_t j = 0; j < 32; ++j)
+                {
+                    unsigned char b = (unsigned char)str[i + j];
+                    high    |= b;
+                    control += (b < 0x20) | (b == 0x7F);
+                }
+                if (high < 0x80) { n += 32 - control; i += 32; continue; }
+                slow = i + 32;
+            }
+
+            unsigned char b = (unsigned char)str[i++];
+            if (left > 0)
+            {
+                if ((b & 0xC0) == 0x80)
+                {
+                    cp = (cp << 6) | (b & 0x3F);
+                    if (--left == 0) n += char_width(cp);
+                    continue;
+                }
+                ++n; // Sequence is cut, b starts a new symbol
+                left = 0;
+            }
+
+            if      (b < 0x80)              n += char_width(b);
+            else if (b >= 0xC2 && b < 0xE0) { cp = b & 0x1F; left = 1; }
+            else if (b >= 0xE0 && b < 0xF0) { cp = b & 0x0F; left = 2; }
+            else if (b >= 0xF0 && b < 0xF5) { cp = b & 0x07; left = 3; }
+            else ++n;
+        }
+        columns = n;
+    }
+};
+
+/* Size of UTF-8 symbol at str, its width is written to columns.
+   Broken sequence takes one column, as in text_width. */
+constexpr std::size_t next_symbol(const char *str, std::size_t len, std::size_t &columns) noexcept
+{
+    unsigned char b = (unsigned char)str[0];
+
+    std::size_t need = (b >= 0xC2 && b < 0xE0) ? 1 :
+                       (b >= 0xE0 && b < 0xF0) ? 2 :
+                       (b >= 0xF0 && b < 0xF5) ? 3 : 0;
+    if (need == 0)
+    {
+        columns = b < 0x80 ? char_width(b) : 1;
+        return 1;
+    }
+
+    char32_t cp = b & (0x3F >> need);
+    std::size_t i = 1;
+    for (; i <= need && i < len && (str[i] & 0xC0) == 0x80; ++i) cp = (cp << 6) | (str[i] & 0x3F);
+
+    columns = i == need + 1 ? char_width(cp) : 1;
+    return i;
+}
+
+/* Size of SGR escape "\033[<codes>m" at str, 0 if there is none. */
+constexpr std::size_t sgr_size(const char *str, std::size_t len) noexcept
+{
+    if (len < 3 || str[0] != '\033' || str[1] != '[') return 0;
+
+    for (std::size_t i = 2; i < len; ++i)
+    {
+        if (str[i] == 'm') return i + 1;
+        if (str[i] != ';' && (str[i] < '0' || str[i] > '9')) return 0;
+    }
+    return 0;
+}
+
+/* Applies codes of SGR escape of size bytes at str to s. */
+constexpr void apply_sgr(const char *str, std::size_t size, style &s) noexcept
+{
+    using ansi::Effect;
+
+    std::size_t i = 2, end = size - 1; // Between "\033[" and 'm'
+    auto next = [&]() {
+        unsigned value = 0;
+        for (; i < end && str[i] != ';'; ++i) if (value < 1000) value = value * 10 + unsigned(str[i] - '0');
+        if (i < end) ++i;
+        return value;
+    };
+
+    do {
+        unsigned n = next();
+        if (n != (unsigned)Effect::rgb_fg && n != (unsigned)Effect::rgb_bg)
+        {
+            if (n <= (unsigned)Effect::bright_white_bg) s.apply(code{(Effect)n});
+            continue;
+        }
+
+        code c{(Effect)n};
+        unsigned kind = next();
+        if (kind == 5)
+        {
+            c.r = (unsigned char)next();
+            c.indexed = true;
+        }
+        else if (kind == 2)
+        {
+            c.r = (unsigned char)next();
+            c.g = (unsigned char)next();
+            c.b = (unsigned char)next();
+        }
+        else continue;
+        s.apply(c);
+    } while (i < end);
+}
+
+/* Place of rendered text a slice may be started from:
+   columns of text before it and style escapes set there. */
+struct slice_point {
+    std::size_t column = 0;
+    std::size_t offset = 0;
+    detail::style style;
+};
+
+#if defined(COLTEXT_STATS)
+/* Counters of one thread. Only it writes them, get_stats() 
+   reads them all, so relaxed loads and stores are enough. */
+struct thread_counters {
+    std::atomic<std::uint64_t> bytes_parsed{0};
+    std::atomic<std::uint64_t> bytes_written{0};
+    std::atomic<std::uint64_t> tags_resolved{0};
+    std::atomic<std::uint64_t> tags_unknown{0};
+    std::atomic<std::uint64_t> max_depth{0};
+    std::atomic<std::uint64_t> allocations{0};
+    std::atomic<std::uint64_t> renders{0};
+    std::atomic<std::uint64_t> render_ns{0};
+
+    unsigned      timing = 0;     // Timed calls on the stack
+    std::uint64_t call_depth = 0; // Deepest nesting in the outermost one
+};
+
+inline stats load(const thread_counters &c) noexcept
+{
+    constexpr auto relaxed = std::memory_order_relaxed;
+
+    stats s;
+    s.bytes_parsed  = c.bytes_parsed.load(relaxed);
+    s.bytes_written = c.bytes_written.load(relaxed);
+    s.tags_resolved = c.tags_resolved.load(relaxed);
+    s.tags_unknown  = c.tags_unknown.load(relaxed);
+    s.max_depth     = c.max_depth.load(relaxed);
+    s.allocations   = c.allocations.load(relaxed);
+    s.renders       = c.renders.load(relaxed);
+    s.render_ns     = c.render_ns.load(relaxed);
+    return s;
+}
+
+inline void merge(stats &to, const stats &from) noexcept
+{
+    to.bytes_parsed  += from.bytes_parsed;
+    to.bytes_written += from.bytes_written;
+    to.tags_resolved += from.tags_resolved;
+    to.tags_unknown  += from.tags_unknown;
+    to.allocations   += from.allocations;
+    to.renders       += from.renders;
+    to.render_ns     += from.render_ns;
+    if (from.max_depth > to.max_depth) to.max_depth = from.max_depth;
+}
+
+/* Counters of live threads and totals of finished ones. */
+struct stats_registry {
+    std::mutex mutex;
+    std::vector<const thread_counters *> threads;
+    stats retired;
+};
+
+inline stats_registry & registry()
+{
+    static stats_registry r;
+    return r;
+}
+
+/* Registers counters of a thread for its lifetime. */
+struct thread_stats {
+    thread_counters counters;
+
+    thread_stats()
+    {
+        stats_registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.threads.push_back(&counters);
+    }
+
+    ~thread_stats()
+    {
+        stats_registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        merge(r.retired, load(counters));
+        for (std::size_t i = 0; i < r.threads.size(); ++i)
+        {
+            if (r.threads[i] != &counters) continue;
+            r.threads[i] = r.threads.back();
+            r.threads.pop_back();
+            break;
+        }
+    }
+};
+
+inline thread_counters & local_counters()
+{
+    thread_local thread_stats t;
+    return t.counters;
+}
+
+inline std::atomic<stats_hook> stats_callback{nullptr};
+
+/* Adds n to counter of this thread, not at compile time. */
+inline COLTEXT_CONSTEXPR void count(std::atomic<std::uint64_t> thread_counters::*counter, std::uint64_t n) noexcept
+{
+#ifdef COLTEXT_STATIC_LITERALS
+    if (std::is_constant_evaluated()) return;
+#endif
+    std::atomic<std::uint64_t> &c = local_counters().*counter;
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline COLTEXT_CONSTEXPR void count_depth(std::uint64_t depth) noexcept
+{
+#ifdef COLTEXT_STATIC_LITERALS
+    if (std::is_constant_evaluated()) return;
+#endif
+    thread_counters &c = local_counters();
+    if (depth > c.call_depth) c.call_depth = depth;
+    if (depth > c.max_depth.load(std::memory_order_relaxed)) c.max_depth.store(depth, std::memory_order_relaxed);
+}
+
+/* Times the outermost of nested calls and reports its work to hook. */
+class stats_timer {
+public:
+    stats_timer()
+    : counters(local_counters())
+    {
+        if (counters.timing++ > 0) return;
+
+        counters.call_depth = 0;
+        before = load(counters);
+        start = std::chrono::steady_clock::now();
+    }
+
+    stats_timer(const stats_timer &) = delete;
+    stats_timer & operator= (const stats_timer &) = delete;
+
+    ~stats_timer()
+    {
+        if (--counters.timing > 0) return;
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        count(&thread_counters::render_ns, (std::uint64_t)ns.count());
+        count(&thread_counters::renders, 1);
+
+        stats_hook f = stats_callback.load(std::memory_order_acquire);
+        if (!f) return;
+
+        stats now = load(counters), work;
+        work.bytes_parsed  = now.bytes_parsed  - before.bytes_parsed;
+        work.bytes_written = now.bytes_written - before.bytes_written;
+        work.tags_resolved = now.tags_resolved - before.tags_resolved;
+        work.tags_unknown  = now.tags_unknown  - before.tags_unknown;
+        work.max_depth     = counters.call_depth;
+        work.allocations   = now.allocations   - before.allocations;
+        work.renders       = 1;
+        work.render_ns     = (std::uint64_t)ns.count();
+        f(work);
+    }
+
+private:
+    thread_counters &counters;
+    stats before;
+    std::chrono::steady_clock::time_point start;
+};
+
+#define COLTEXT_COUNT(counter, n) ::coltext::detail::count(&::coltext::detail::thread_counters::counter, (n))
+#define COLTEXT_COUNT_DEPTH(depth) ::coltext::detail::count_depth(depth)
+#define COLTEXT_TIMED() ::coltext::detail::stats_timer coltext_timer_
+#else
+#define COLTEXT_COUNT(counter, n) ((void)0)
+#define COLTEXT_COUNT_DEPTH(depth) ((void)0)
+#define COLTEXT_TIMED() ((void)0)
+#endif // COLTEXT_STATS
+
+/* Points at the start, after every escape and every 64 bytes
+   of text, so a slice is found by binary search and a short walk. */
+template <class Points>
+void index_slices(std::string_view colored, Points &points)
+{
+    constexpr std::size_t step = 64;
+
+    slice_point point;
+    COLTEXT_COUNT(allocations, points.size() == points.capacity());
+    points.push_back(point);
+
+    for (std::size_t i = 0, last = 0; i < colored.size(); )
+    {
+        if (std::size_t n = sgr_size(colored.data() + i, colored.size() - i))
+        {
+            apply_sgr(colored.data() + i, n, point.style);
+            i += n;
+        }
+        else
+        {
+            std::size_t columns = 0;
+            i += next_symbol(colored.data() + i, colored.size() - i, columns);
+            point.column += columns;
+            if (i - last < step) continue;
+        }
+
+        point.offset = i;
+        COLTEXT_COUNT(allocations, points.size() == points.capacity());
+        points.push_back(point);
+        last = i;
+    }
+}
+
+/* Stack keeping first N elements in place and the rest on heap,
+   so usual nesting depth costs no allocations. */
+template <class T, std::size_t N, class Alloc = std::allocator<T>>
+class small_stack {
+public:
+    small_stack() = default;
+
+    explicit COLTEXT_CONSTEXPR small_stack(const Alloc &alloc)
+    : heap(alloc)
+    {}
+
+    COLTEXT_CONSTEXPR Alloc get_allocator() const { return heap.get_allocator(); }
+
+    constexpr bool        empty() const noexcept { return count == 0; }
+    constexpr std::size_t size()  const noexcept { return count; }
+
+    constexpr const T & top() const
+    {
+        return count <= N ? local[count - 1] : heap.back();
+    }
+
+    COLTEXT_CONSTEXPR void push(const T &value)
+    {
+        if (count < N) local[count] = value;
+        else
+        {
+            COLTEXT_COUNT(allocations, heap.size() == heap.capacity());
+            heap.push_back(value);
+        }
+        ++count;
+    }
+
+    COLTEXT_CONSTEXPR void pop()
+    {
+        if (--count >= N) heap.pop_back();
+    }
+
+private:
+    T local[N] = {};
+    std::size_t count = 0;
+    std::vector<T, Alloc> heap;
+};
+
+/**
+ * @class basic_machine
+ * @brief:
+ *  Single pass Coltext parser. Does the work of tokenize and 
+ *  apply_effects at once and writes the result to a sink:
+ *      sink.text(const char *, size_t) for plain text;
+ *      sink.effect(const code &)       for ANSI effects.
+ *  If Sink::effects is false, effect stacks are not kept at all.
+ *  Compact machine tracks terminal style instead of writing effects
+ *  and writes one escape only when text with a new style starts,
+ *  or calls sink.set_style(const style &) if Sink::styles is true.
+ *  rgb colors are downsampled to `colors` once, when tag is parsed.
+ *  Measuring machine counts columns of text as it's written.
+ *  State is kept between feed() calls, so text may come in chunks.
+ *  Deep nesting is kept in memory of Alloc.
+ *  Work is linear in the input: every byte is looked at once, tags 
+ *  are buffered up to max_tag_size bytes and every effect is opened
+ *  and closed once. Memory doesn't grow past limits::max_depth.
+ */
+template <class Alloc = std::allocator<char>>
+class basic_machine {
+public:
+    COLTEXT_CONSTEXPR basic_machine() = default;
+
+    explicit COLTEXT_CONSTEXPR basic_machine(bool compact, const Alloc &alloc = Alloc())
+    : basic_machine(compact, color_depth::truecolor, coltext::limits(), alloc)
+    {}
+
+    COLTEXT_CONSTEXPR basic_machine(bool compact, color_depth colors, 
+                                    const coltext::limits &bounds, const Alloc &alloc = Alloc())
+    : bounds(bounds),
+      effects(alloc),
+      last_fg(alloc),
+      last_bg(alloc),
+      compact(compact),
+      colors(colors)
+    {
+        if (this->bounds.max_tag_size > max_tag_size) this->bounds.max_tag_size = max_tag_size;
+    }
+
+    COLTEXT_CONSTEXPR Alloc get_allocator() const { return Alloc(effects.get_allocator()); }
+
+    template <class Sink>
+    COLTEXT_CONSTEXPR void feed(const char *str, std::size_t len, Sink &out)
+    {
+        fed += len;
+        COLTEXT_COUNT(bytes_parsed, len);
+
+        std::size_t i = 0;
+        while (i < len)
+        {
+            if (state == State::escape)
+            {
+                state = State::text;
+                if (is_escapable(str[i])) { put(out, str + i, 1); ++i; }
+                else stop(out); // Lone '\\' closes effect, next symbol is as usual
+                continue;
+            }
+
+            if (state == State::tag)
+            {// Get the whole tag
+                std::size_t begin = i;
+                while (i < len && str[i] != '(' && str[i] != ' ') ++i;
+                append_tag(str + begin, i - begin, out);
+
+                if (i < len) end_tag(str[i++], out);
+                continue;
+            }
+
+            std::size_t begin = i;
+            i += scan(str + i, len - i, num_wait_closing != 0, wait_next_word);
+            if (i > begin) put(out, str + begin, i - begin);
+            if (i == len) break;
+
+            char c = str[i++];
+            if (c == '\\') state = State::escape;
+            else
+            if (c == '#' || c == '<')
+            {// Coltext tags found
+                state = State::tag;
+                tag[0] = c;
+                tag_size = 1;
+                tag_overflow = false;
+            }
+            else
+            {// ')' or ' ' after a word closes the innermost scope
+                stop(out);
+                wait_next_word = false;
+                if (c == ' ') put(out, " ", 1);
+            }
+        }
+    }
+
+    /* Flushes pending input and silently closes open effects. */
+    template <class Sink>
+    COLTEXT_CONSTEXPR void finish(Sink &out)
+    {
+        if (state == State::escape) stop(out);
+        if (state == State::tag) end_tag('(', out);
+
+        // Scopes left when all effects are closed write nothing. Effects are
+        // closed even if stray ')' or '\\' left the scope count below them
+        while (ignore_stop || num_dropped > 0 || !effects.empty()) stop(out);
+
+        if constexpr (Sink::effects)
+        {
+            if (compact && shown != wanted) show(out);
+        }
+
+        bool measured = measure;
+        std::size_t written = width.columns;
+        *this = basic_machine(compact, colors, bounds, get_allocator());
+        measure = measured;
+        width.columns = written;
+    }
+
+    /* Columns of text written since the machine was made. */
+    COLTEXT_CONSTEXPR void measure_columns(bool on) noexcept { measure = on; }
+    constexpr std::size_t columns() const noexcept { return width.columns; }
+
+    /* Whether finish() would write nothing and feed() 
+       would work as for the new machine. */
+    constexpr bool neutral() const noexcept
+    {
+        return state == State::text && !wait_next_word && !ignore_stop &&
+               num_wait_closing == 0 && num_dropped == 0 && effects.empty() && 
+               last_fg.empty() && last_bg.empty() &&
+               shown == style() && wanted == style() && width.left == 0;
+    }
+
+    /* Whether the last symbol fed is plain text, not a tag or '\\'. */
+    constexpr bool in_text() const noexcept { return state == State::text; }
+
+    /* Writes style of compact machine, so text written 
+       straight to out next has the same effects as fed one. */
+    template <class Sink>
+    COLTEXT_CONSTEXPR void sync(Sink &out)
+    {
+        if constexpr (Sink::effects)
+        {
+            if (compact && shown != wanted) show(out);
+        }
+    }
+
+private:
+    enum class State : unsigned char { text, escape, tag };
+
+    static constexpr bool is_escapable(char c) noexcept
+    {
+        return c == '#' || c == '<' || c == '(' || c == ')';
+    }
+
+    template <class Sink>
+    COLTEXT_CONSTEXPR void put(Sink &out, const char *str, std::size_t len)
+    {
+        if (len == 0) return;
+
+        if constexpr (Sink::effects)
+        {
+            if (compact && shown != wanted) show(out);
+        }
+        if (measure) width.add(str, len);
+        COLTEXT_COUNT(bytes_written, len);
+        out.text(str, len);
+    }
+
+    /* Writes style change, or passes the new style to sinks taking styles. */
+    template <class Sink>
+    COLTEXT_CONSTEXPR void show(Sink &out)
+    {
+        if constexpr (takes_styles<Sink>::value) out.set_style(wanted);
+        else
+        {
+            [[maybe_unused]] std::size_t n = write_style(shown, wanted, out);
+            COLTEXT_COUNT(bytes_written, n);
+        }
+        shown = wanted;
+    }
+
+    template <class Sink>
+    COLTEXT_CONSTEXPR void put(Sink &out, const code &c)
+    {
+        if (compact) { wanted.apply(c); return; }
+
+#if defined(COLTEXT_STATS)
+        char esc[20] = {};
+        COLTEXT_COUNT(bytes_written, format_code(c, esc));
+#endif
+        out.effect(c);
+    }
+
+    template <class Sink>
+    COLTEXT_CONSTEXPR void append_tag(const char *str, std::size_t len, Sink &out)
+    {
+        if (!tag_overflow && tag_size + len > bounds.max_tag_size)
+        {// Too long for any effect, so it's text anyway
+            put(out, tag, tag_size);
+            tag_overflow = true;
+        }
+
+        if (tag_overflow) put(out, str, len);
+        else for (std::size_t i = 0; i < len; ++i) tag[tag_size++] = str[i];
+    }
+
+    template <class Sink>
+    COLTEXT_CONSTEXPR void end_tag(char last, Sink &out)
+    {
+        state = State::text;
+        ++num_wait_closing;
+        if (last == ' ') wait_next_word = true;
+
+        code c;
+        if (tag_overflow || !resolve(std::string_view(tag, tag_size), c))
+        {/* If it's not a valid effect, 
+            we just leave it as text */
+            if (!tag_overflow) put(out, tag, tag_size);
+            put(out, &last, 1);
+            ignore_stop = true;
+            COLTEXT_COUNT(tags_unknown, 1);
+            return;
+        }
+        c = downsample(c, colors);
+        COLTEXT_COUNT(tags_resolved, 1);
+
+        if constexpr (Sink::effects)
+        {
+            if (num_dropped > 0 || effects.size() >= bounds.max_depth || !afford(c))
+            {// Over limits, so tags in it are dropped too
+                ++num_dropped;
+                return;
+            }
+
+            effects.push(c.effect);
+            COLTEXT_COUNT_DEPTH(effects.size());
+            if      (ansi::is_bg(c.effect)) last_bg.push(c);
+            else if (ansi::is_fg(c.effect)) last_fg.push(c);
+
+            put(out, c);
+        }
+    }
+
+    template <class Sink>
+    COLTEXT_CONSTEXPR void stop(Sink &out)
+    {
+        --num_wait_closing;
+
+        if (ignore_stop) { ignore_stop = false; return; }
+        if (!Sink::effects) return;
+        if (num_dropped > 0) { --num_dropped; return; }
+        if (effects.empty()) return;
+
+        ansi::Effect e = effects.top();
+        effects.pop();
+
+        if      (ansi::is_bg(e)) last_bg.pop();
+        else if (ansi::is_fg(e)) last_fg.pop();
+
+        put(out, undo(e));
+    }
+
+    /* Effect that undoes e, if e is on top of the stacks. */
+    constexpr code undo(ansi::Effect e) const
+    {
+        if (ansi::is_bg(e)) return last_bg.empty() ? code{ansi::Effect::default_bg} : last_bg.top();
+        if (ansi::is_fg(e)) return last_fg.empty() ? code{ansi::Effect::default_fg} : last_fg.top();
+        return code{ansi::to_off(e)};
+    }
+
+    /* Whether escapes of c and of its closing fit max_expansion. */
+    COLTEXT_CONSTEXPR bool afford(const code &c)
+    {
+        if (bounds.max_expansion == 0) return true;
+
+        // c is not pushed yet, so undo() gives what its closing restores
+        char esc[20] = {};
+        std::size_t cost = format_code(c, esc) + format_code(undo(c.effect), esc);
+        if (spent + cost > fed * bounds.max_expansion) return false;
+
+        spent += cost;
+        return true;
+    }
+
+    State state = State::text;
+    bool wait_next_word = false;
+    bool ignore_stop    = false;
+    bool tag_overflow   = false;
+    std::ptrdiff_t num_wait_closing = 0;
+    std::size_t    num_dropped = 0; // Open tags over limits
+
+    coltext::limits bounds;
+    std::size_t fed   = 0; // Bytes of markup
+    std::size_t spent = 0; // Bytes of escapes, closing ones included
+
+    char tag[max_tag_size] = {};
+    std::size_t tag_size = 0;
+
+    template <class T>
+    using alloc_for = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+    small_stack<ansi::Effect, 16, alloc_for<ansi::Effect>> effects;
+    small_stack<code, 8, alloc_for<code>> last_fg;
+    small_stack<code, 8, alloc_for<code>> last_bg;
+
+    bool  compact = false;
+    color_depth colors = color_depth::truecolor;
+    bool measure = false;
+    text_width width;
+    style shown;  // Style of the last written text
+    style wanted; // Style for the next text
+};
+
+using machine = basic_machine<>;
+
+/* Sink that appends everything to a string. */
+template <class String>
+struct string_sink {
+    static constexpr bool effects = true;
+    String &str;
+
+    COLTEXT_CONSTEXPR void text(const char *s, std::size_t len) { str.append(s, len); }
+
+    COLTEXT_CONSTEXPR void effect(const code &c)
+    {
+        if (!ansi::is_rgb(c.effect))
+        {
+            std::string_view esc = ansi::escape(c.effect);
+            str.append(esc.data(), esc.size());
+            return;
+        }
+
+        char buf[20] = {};
+        str.append(buf, format_code(c, buf));
+    }
+};
+
+/* Sink that writes everything straight into stream buffer. */
+struct streambuf_sink {
+    static constexpr bool effects = true;
+    std::streambuf *buf;
+    bool good = true;
+
+    void text(const char *s, std::size_t len)
+    {
+        if (buf->sputn(s, (std::streamsize)len) != (std::streamsize)len) good = false;
+    }
+
+    void effect(const code &c)
+    {
+        char esc[20];
+        text(esc, format_code(c, esc));
+    }
+};
+
+/* Passes text only, so markup is just removed. */
+template <class Sink>
+struct text_only {
+    static constexpr bool effects = false;
+    Sink &out;
+
+    COLTEXT_CONSTEXPR void text(const char *s, std::size_t len) { out.text(s, len); }
+    COLTEXT_CONSTEXPR void effect(const code &) {}
+};
+
+/* Drops everything, for machines that only measure text. */
+struct discard_sink {
+    static constexpr bool effects = false;
+
+    COLTEXT_CONSTEXPR void text(const char *, std::size_t) {}
+    COLTEXT_CONSTEXPR void effect(const code &) {}
+};
+
+/* Parses with or without ANSI escapes. The same 
+   machine must always be used in the same mode. */
+template <class Alloc, class Sink>
+COLTEXT_CONSTEXPR void feed(basic_machine<Alloc> &m, const char *str, std::size_t len, Sink &out, bool plain)
+{
+    if (!plain) return m.feed(str, len, out);
+
+    text_only<Sink> text{out};
+    m.feed(str, len, text);
+}
+
+template <class Alloc, class Sink>
+COLTEXT_CONSTEXPR void finish(basic_machine<Alloc> &m, Sink &out, bool plain)
+{
+    if (!plain) return m.finish(out);
+
+    text_only<Sink> text{out};
+    m.finish(text);
+}
+
+#ifdef COLTEXT_STATIC_LITERALS
+
+template <std::size_t N>
+struct fixed_string {
+    char value[N] = {};
+
+    constexpr fixed_string(const char (&str)[N]) 
+    {
+        for (std::size_t i = 0; i < N; ++i) value[i] = str[i];
+    }
+
+    constexpr std::size_t size() const { return N - 1; }
+};
+
+constexpr std::string render(const char *str, std::size_t len, bool plain, bool compact = false)
+{
+    std::string out;
+    string_sink<std::string> sink{out};
+
+    machine m(compact);
+    feed(m, str, len, sink, plain);
+    finish(m, sink, plain);
+    return out;
+}
+
+#endif // COLTEXT_STATIC_LITERALS
+
+} // namespace detail
+
+
+/** 
+ * @enum class render_mode
+ * @brief:
+ *  How Coltext is printed: with ANSI escapes, as plain text 
+ *  with markup removed, or automatic: escapes only for terminals
+ *  (isatty) that have TERM or COLORTERM set, unless NO_COLOR is set.
+ */
+enum class render_mode {
+    ansi,
+    plain,
+    automatic
+};
+
+namespace detail {
+
+inline std::atomic<render_mode> default_mode{render_mode::ansi};
+
+/* Whether fd is a terminal showing colors. */
+COLTEXT_INLINE bool terminal_has_colors(int fd);
+
+/* Only standard streams may be terminals. Checked once. */
+COLTEXT_INLINE bool has_colors(const std::streambuf *buf);
+
+/* Buffer of std::cout, Coltext made outside of any stream is rendered for it. */
+COLTEXT_INLINE std::streambuf * stdout_buf();
+
+#if defined(COLTEXT_DEFINE_SYSTEM)
+COLTEXT_INLINE bool terminal_has_colors(int fd)
+{
+    const char *no_color  = std::getenv("NO_COLOR");
+    const char *term      = std::getenv("TERM");
+    const char *colorterm = std::getenv("COLORTERM");
+
+    if (no_color && *no_color) return false;
+    if (!(colorterm && *colorterm) && 
+        !(term && *term && std::string_view(term) != "dumb")) return false;
+
+#if defined(_WIN32)
+    return _isatty(fd) != 0;
+#else
+    return isatty(fd) != 0;
+#endif
+}
+
+COLTEXT_INLINE bool has_colors(const std::streambuf *buf)
+{
+    static const bool out = terminal_has_colors(1);
+    static const bool err = terminal_has_colors(2);
+
+    if (buf == std::cout.rdbuf()) return out;
+    if (buf == std::cerr.rdbuf() || buf == std::clog.rdbuf()) return err;
+    return false;
+}
+
+COLTEXT_INLINE std::streambuf * stdout_buf()
+{
+    return std::cout.rdbuf();
+}
+#endif // COLTEXT_DEFINE_SYSTEM
+
+inline int mode_index()
+{
+    static const int index = std::ios_base::xalloc();
+    return index;
+}
+
+inline std::atomic<bool> default_compact{false};
+
+inline int compact_index()
+{
+    static const int index = std::ios_base::xalloc();
+    return index;
+}
+
+inline std::atomic<color_depth> default_colors{color_depth::truecolor};
+
+inline int colors_index()
+{
+    static const int index = std::ios_base::xalloc();
+    return index;
+}
+
+inline std::atomic<std::size_t> default_max_depth{limits().max_depth};
+inline std::atomic<std::size_t> default_max_tag_size{limits().max_tag_size};
+inline std::atomic<std::size_t> default_max_expansion{limits().max_expansion};
+
+} // namespace detail
+
+/* Process-wide mode. It's used by streams with no mode of their own. */
+inline void set_render_mode(render_mode mode) noexcept
+{
+    detail::default_mode.store(mode, std::memory_order_relaxed);
+}
+
+inline render_mode get_render_mode() noexcept
+{
+    return detail::default_mode.load(std::memory_order_relaxed);
+}
+
+/* Mode of a single stream. Example: set_render_mode(file, render_mode::plain); */
+inline void set_render_mode(std::ios_base &stream, render_mode mode)
+{
+    stream.iword(detail::mode_index()) = (long)mode + 1;
+}
+
+inline render_mode get_render_mode(std::ios_base &stream)
+{
+    long mode = stream.iword(detail::mode_index());
+    return mode == 0 ? get_render_mode() : (render_mode)(mode - 1);
+}
+
+/* Compact escapes: effects are merged into one escape like "\033[1;31;44m"
+   written right before text, escapes that change nothing are dropped.
+   Terminal shows the same, output gets smaller. Off by default. */
+inline void set_compact_escapes(bool compact) noexcept
+{
+    detail::default_compact.store(compact, std::memory_order_relaxed);
+}
+
+inline bool get_compact_escapes() noexcept
+{
+    return detail::default_compact.load(std::memory_order_relaxed);
+}
+
+inline void set_compact_escapes(std::ios_base &stream, bool compact)
+{
+    stream.iword(detail::compact_index()) = (long)compact + 1;
+}
+
+inline bool get_compact_escapes(std::ios_base &stream)
+{
+    long compact = stream.iword(detail::compact_index());
+    return compact == 0 ? get_compact_escapes() : compact == 2;
+}
+
+/* Colors of terminal: #rgb and #RGB are printed as the nearest color 
+   it has. Truecolor by default. Example: set_color_depth(color_depth::xterm256); */
+inline void set_color_depth(color_depth colors) noexcept
+{
+    detail::default_colors.store(colors, std::memory_order_relaxed);
+}
+
+inline color_depth get_color_depth() noexcept
+{
+    return detail::default_colors.load(std::memory_order_relaxed);
+}
+
+inline void set_color_depth(std::ios_base &stream, color_depth colors)
+{
+    stream.iword(detail::colors_index()) = (long)colors + 1;
+}
+
+inline color_depth get_color_depth(std::ios_base &stream)
+{
+    long colors = stream.iword(detail::colors_index());
+    return colors == 0 ? get_color_depth() : (color_depth)(colors - 1);
+}
+
+/* Process-wide limits of markup parsing, used by Coltext rendered
+   after the call. Example: set_limits({64, 17, 4}); */
+inline void set_limits(const limits &bounds) noexcept
+{
+    detail::default_max_depth.store(bounds.max_depth, std::memory_order_relaxed);
+    detail::default_max_tag_size.store(bounds.max_tag_size, std::memory_order_relaxed);
+    detail::default_max_expansion.store(bounds.max_expansion, std::memory_order_relaxed);
+}
+
+inline limits get_limits() noexcept
+{
+    return {detail::default_max_depth.load(std::memory_order_relaxed),
+            detail::default_max_tag_size.load(std::memory_order_relaxed),
+            detail::default_max_expansion.load(std::memory_order_relaxed)};
+}
+
+/* Work of all threads since the program started, 
+   zero unless COLTEXT_STATS is defined. */
+inline stats get_stats()
+{
+    stats total;
+#if defined(COLTEXT_STATS)
+    detail::stats_registry &r = detail::registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    total = r.retired;
+    for (const detail::thread_counters *c : r.threads) detail::merge(total, detail::load(*c));
+#endif
+    return total;
+}
+
+/* Hook called with the work of every timed call on the thread 
+   that made it, nullptr removes it. Does nothing without COLTEXT_STATS. 
+   Example: set_stats_hook([](const coltext::stats &s) { histogram.add(s.render_ns); }); */
+inline void set_stats_hook([[maybe_unused]] stats_hook hook) noexcept
+{
+#if defined(COLTEXT_STATS)
+    detail::stats_callback.store(hook, std::memory_order_release);
+#endif
+}
+
+namespace detail {
+
+/* Whether markup is printed to buf without escapes. */
+inline bool is_plain(render_mode mode, const std::streambuf *buf)
+{
+    if (mode == render_mode::automatic) return !has_colors(buf);
+    return mode == render_mode::plain;
+}
+
+inline bool is_plain(std::ostream &os)
+{
+    return is_plain(get_render_mode(os), os.rdbuf());
+}
+
+/* Mode of Coltext constructed outside of any stream. 
+   Automatic mode renders it for std::cout. */
+inline bool is_plain()
+{
+    return is_plain(get_render_mode(), stdout_buf());
+}
+
+inline render_config config_for(std::ostream &os)
+{
+    return {is_plain(os), get_compact_escapes(os), get_color_depth(os)};
+}
+
+inline render_config config_for()
+{
+    return {is_plain(), get_compact_escapes(), get_color_depth()};
+}
+
+} // namespace detail
+
+
+/**
+ * @class static_text
+ * @brief:
+ *  Result of "text"_col parsed at compile time. 
+ *  Holds markup and escaped text as static char arrays,
+ *  so printing it costs as much as printing a C string.
+ */
+template <std::size_t N, std::size_t M, std::size_t P, std::size_t C>
+struct static_text {
+    char source[N];  // Coltext markup, null terminated
+    char colored[M]; // Text with ANSI escapes, null terminated
+    char plain[P];   // Text with markup removed, null terminated
+    char compact[C]; // Text with compact escapes, null terminated
+
+    constexpr const char * c_str() const noexcept { return colored; }
+    constexpr std::size_t  size()  const noexcept { return M - 1; }
+
+    constexpr operator std::string_view () const noexcept
+    {
+        return std::string_view(colored, M - 1);
+    }
+
+    operator Coltext () const { return Coltext(source, N - 1); }
+
+    friend Coltext operator+ (const static_text &lhs, const Coltext &rhs)
+    {
+        return Coltext(lhs) + rhs;
+    }
+
+    friend std::ostream & operator<< (std::ostream &os, const static_text &text)
+    {
+        if (detail::is_plain(os))         return os << std::string_view(text.plain, P - 1);
+        if (get_color_depth(os) != color_depth::truecolor) return os << Coltext(text);
+        if (get_compact_escapes(os))      return os << std::string_view(text.compact, C - 1);
+        return os << std::string_view(text);
+    }
+};
+
+#ifdef COLTEXT_STATIC_LITERALS
+namespace detail {
+
+template <fixed_string S>
+constexpr auto make_static_text()
+{
+    constexpr std::size_t size  = render(S.value, S.size(), false).size();
+    constexpr std::size_t plain = render(S.value, S.size(), true).size();
+    constexpr std::size_t compact = render(S.value, S.size(), false, true).size();
+    static_text<sizeof(S.value), size + 1, plain + 1, compact + 1> text{};
+
+    for (std::size_t i = 0; i < sizeof(S.value); ++i) text.source[i] = S.value[i];
+
+    std::string colored = render(S.value, S.size(), false);
+    for (std::size_t i = 0; i < size; ++i) text.colored[i] = colored[i];
+
+    colored = render(S.value, S.size(), true);
+    for (std::size_t i = 0; i < plain; ++i) text.plain[i] = colored[i];
+
+    colored = render(S.value, S.size(), false, true);
+    for (std::size_t i = 0; i < compact; ++i) text.compact[i] = colored[i];
+    return text;
+}
+
+template <fixed_string S>
+inline constexpr auto static_literal = make_static_text<S>();
+
+} // namespace detail
+#endif // COLTEXT_STATIC_LITERALS
+
+} // namespace coltext
+
+#ifdef COLTEXT_STATIC_LITERALS
+inline namespace literals {
+    /* Parsed at compile time. Without static literals
+       operator"" _col(const char *, size_t) makes Coltext instead,
+       both can't be declared: the runtime one would always win. */
+    template <coltext::detail::fixed_string S>
+    constexpr const auto & operator"" _col()
+    {
+        return coltext::detail::static_literal<S>;
+    }
+};
+#endif // COLTEXT_STATIC_LITERALS
+
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext() 
+: str(""),
+  colored_str(""),
+  config(coltext::detail::config_for())
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const Alloc &alloc) 
+: str(alloc),
+  colored_str(alloc),
+  config(coltext::detail::config_for())
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const char *str, const Alloc &alloc) 
+: basic_coltext(std::string_view(str), alloc)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const char *str, size_t len, const Alloc &alloc)
+: str(str, len, alloc),
+  colored_str(alloc),
+  rendered(false)
+{
+    this->render();
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const std::string &str, const Alloc &alloc)
+: basic_coltext(str.data(), str.size(), alloc)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(std::string_view str, const Alloc &alloc)
+: basic_coltext(str.data(), str.size(), alloc)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(string_type &&str)
+: str(std::move(str)),
+  colored_str(this->str.get_allocator()),
+  rendered(false)
+{
+    this->render();
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const char *str, coltext::lazy_t, const Alloc &alloc)
+: basic_coltext(std::string_view(str), coltext::lazy, alloc)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const char *str, size_t len, coltext::lazy_t, const Alloc &alloc)
+: str(str, len, alloc),
+  colored_str(alloc),
+  rendered(false)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(std::string_view str, coltext::lazy_t, const Alloc &alloc)
+: basic_coltext(str.data(), str.size(), coltext::lazy, alloc)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(string_type &&str, coltext::lazy_t)
+: str(std::move(str)),
+  colored_str(this->str.get_allocator()),
+  rendered(false)
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const basic_coltext &other)
+: basic_coltext(other, std::allocator_traits<Alloc>::
+                       select_on_container_copy_construction(other.get_allocator()))
+{};
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc>::basic_coltext(const basic_coltext &other, const Alloc &alloc)
+: str(other.str, alloc),
+  colored_str(other.colored_str, alloc),
+  rendered(other.rendered),
+  config(other.config),
+  source(other.source),
+  closing(other.closing),
+  columns(other.columns),
+  closing_columns(other.closing_columns)
+{
+    this->share_state(other);
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> & basic_coltext<Alloc>::operator= (const basic_coltext &other)
+{
+    if (this == &other) return *this;
+
+    this->str         = other.str;
+    this->colored_str = other.colored_str;
+    this->rendered    = other.rendered;
+    this->config      = other.config;
+    this->source      = other.source;
+    this->closing     = other.closing;
+    this->columns     = other.columns;
+    this->closing_columns = other.closing_columns;
+    this->share_state(other);
+    return *this;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> & basic_coltext<Alloc>::operator= (basic_coltext &&other)
+{
+    if (this == &other) return *this;
+
+    this->str         = std::move(other.str);
+    this->colored_str = std::move(other.colored_str);
+    this->rendered    = other.rendered;
+    this->config      = other.config;
+    this->source      = other.source;
+    this->closing     = other.closing;
+    this->columns     = other.columns;
+    this->closing_columns = other.closing_columns;
+    this->share_state(other);
+    return *this;
+}
+
+template <class Alloc>
+COLTEXT_INLINE Alloc basic_coltext<Alloc>::get_allocator() const
+{
+    return this->str.get_allocator();
+}
+
+template <class Alloc>
+COLTEXT_INLINE auto basic_coltext<Alloc>::colored() const -> const string_type &
+{
+    this->render();
+    return this->colored_str;
+}
+
+template <class Alloc>
+COLTEXT_INLINE void basic_coltext<Alloc>::render() const
+{
+    if (this->rendered) return;
+    this->render(coltext::detail::config_for(), coltext::get_limits());
+}
+
+/* Renders with settings taken once by the caller, not the current ones. */
+template <class Alloc>
+COLTEXT_INLINE void basic_coltext<Alloc>::render(const coltext::detail::render_config &config,
+                                                 const coltext::limits &bounds) const
+{
+    this->config = config;
+    COLTEXT_TIMED();
+
+    // Escapes usually take less than a quarter of the text
+    size_t len = this->str.size();
+    COLTEXT_COUNT(allocations, this->colored_str.capacity() < len + len / 4 + 16);
+    this->colored_str.reserve(len + len / 4 + 16);
+    this->append(this->str.c_str(), len, bounds);
+    this->rendered = true;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> basic_coltext<Alloc>::operator+ (const basic_coltext &rhs) const &
+{
+    basic_coltext result(*this, this->get_allocator());
+    result += rhs;
+    return result;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> basic_coltext<Alloc>::operator+ (const basic_coltext &rhs) &&
+{
+    *this += rhs;
+    return std::move(*this);
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> & basic_coltext<Alloc>::drop_source() &
+{
+    this->render();
+    this->source = false;
+
+    string_type(this->str.get_allocator()).swap(this->str);
+    this->colored_str.shrink_to_fit();
+    return *this;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> && basic_coltext<Alloc>::drop_source() &&
+{
+    return std::move(this->drop_source());
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> & basic_coltext<Alloc>::operator+= (const basic_coltext &rhs)
+{
+    if (!rhs.source)
+    {// Right side can't be parsed, effects of left side are closed before it
+        this->drop_source();
+        this->colored_str += rhs.colored_str;
+        this->state.reset();
+        this->closing = 0;
+        this->closing_columns = 0;
+        this->columns += rhs.columns;
+        this->points.reset();
+        return *this;
+    }
+
+    if (this->rendered) this->append(rhs.str.c_str(), rhs.str.size(), coltext::get_limits());
+    if (this->source) this->str += rhs.str;
+    return *this;
+}
+
+template <class Alloc>
+COLTEXT_INLINE size_t basic_coltext<Alloc>::width() const
+{
+    this->render();
+    return this->columns;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> & basic_coltext<Alloc>::pad_to(size_t n) &
+{
+    // Tag left unfinished takes the first space, so it may take two goes
+    for (size_t width; (width = this->width()) < n; )
+    {
+        string_type spaces(n - width, ' ', this->get_allocator());
+        this->append(spaces.c_str(), spaces.size(), coltext::get_limits());
+        if (this->source) this->str += spaces;
+    }
+    return *this;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> && basic_coltext<Alloc>::pad_to(size_t n) &&
+{
+    return std::move(this->pad_to(n));
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> & basic_coltext<Alloc>::truncate_to(size_t n) &
+{
+    if (this->width() <= n) return *this;
+
+    if (!this->source)
+    {// Only text is cut, escapes are kept so effects are still closed
+        const string_type &from = this->colored_str;
+        string_type cut(this->get_allocator());
+        coltext::detail::text_width width;
+
+        bool full = false;
+        for (size_t i = 0, end; i < from.size(); i = end)
+        {
+            end = i + 1;
+            if (from[i] == '\033')
+            {
+                size_t m = from.find('m', i);
+                end = m == string_type::npos ? from.size() : m + 1;
+                cut.append(from, i, end - i);
+                continue;
+            }
+
+            while (end < from.size() && (from[end] & 0xC0) == 0x80) ++end;
+            if (full) continue;
+
+            coltext::detail::text_width next = width;
+            next.add(&from[i], end - i);
+            if (next.columns > n) { full = true; continue; }
+
+            cut.append(from, i, end - i);
+            width = next;
+        }
+
+        this->colored_str = std::move(cut);
+        this->columns = width.columns;
+        this->points.reset();
+        return *this;
+    }
+
+    // Markup is cut before the symbol, tag or escape going over n
+    machine parser(false, coltext::color_depth::truecolor, coltext::get_limits(), this->get_allocator());
+    parser.measure_columns(true);
+    coltext::detail::discard_sink sink;
+
+    const char *s = this->str.c_str();
+    size_t size = this->str.size(), cut = 0, i = 0;
+    for (size_t end; i < size; i = end)
+    {
+        end = i + 1;
+        while (end < size && (s[end] & 0xC0) == 0x80) ++end;
+
+        if (parser.in_text()) cut = i;
+        parser.feed(s + i, end - i, sink);
+        if (parser.columns() > n) break;
+    }
+    if (i == size && parser.in_text()) return *this;
+
+    this->str.resize(cut);
+    this->colored_str.clear();
+    this->state.reset();
+    this->closing = 0;
+    this->closing_columns = 0;
+    this->columns = 0;
+    this->append(this->str.c_str(), this->str.size(), coltext::get_limits());
+    return *this;
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> && basic_coltext<Alloc>::truncate_to(size_t n) &&
+{
+    return std::move(this->truncate_to(n));
+}
+
+template <class Alloc>
+COLTEXT_INLINE basic_coltext<Alloc> basic_coltext<Alloc>::slice(size_t begin, size_t len) const
+{
+    using coltext::detail::slice_point;
+    using coltext::detail::style;
+
+    this->render();
+
+    // Slices of rendered Coltext may be taken by many threads at once, the first index made is kept
+    std::shared_ptr<const slice_points> shared = this->points.load();
+    if (!shared)
+    {
+        auto made = std::allocate_shared<slice_points>(this->get_allocator(), this->get_allocator());
+        coltext::detail::index_slices(this->colored_str, *made);
+        COLTEXT_COUNT(allocations, 1);
+
+        shared = std::move(made);
+        this->points.publish(shared);
+    }
+
+    // The last point before begin, zero width symbols at begin may go with the symbol before it
+    const slice_points &index = *shared;
+    size_t lo = 0, hi = index.size();
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (index[mid].column < begin) lo = mid;
+        else hi = mid;
+    }
+    const slice_point &from = index[lo];
+
+    basic_coltext result(this->get_allocator());
+    result.config = this->config;
+    result.source = false;
+
+    string_type &out = result.colored_str;
+    coltext::detail::string_sink<string_type> sink{out};
+
+    const char *s = this->colored_str.c_str();
+    size_t size = this->colored_str.size();
+    size_t end  = len > string_type::npos - begin ? string_type::npos : begin + len;
+
+    style now = from.style, shown;
+    size_t column = from.column;
+    bool take = begin <= column && column < end; // Zero width symbols go with the previous one
+    for (size_t i = from.offset; i < size; )
+    {
+        if (size_t n = coltext::detail::sgr_size(s + i, size - i))
+        {
+            coltext::detail::apply_sgr(s + i, n, now);
+            i += n;
+            continue;
+        }
+
+        size_t width = 0;
+        size_t n = coltext::detail::next_symbol(s + i, size - i, width);
+        if (width > 0)
+        {
+            if (column + width > end) break;
+            take = column >= begin;
+        }
+
+        if (take)
+        {
+            if (shown != now) coltext::detail::write_style(shown, now, sink);
+            shown = now;
+            out.append(s + i, n);
+            result.columns += width;
+        }
+        column += width;
+        i += n;
+    }
+
+    if (shown != style()) coltext::detail::write_style(shown, style(), sink);
+    return result;
+}
+
+/* Continues parsing from the end of this->str, 
+   replacing old closing escapes by new ones. */
+template <class Alloc>
+COLTEXT_INLINE void basic_coltext<Alloc>::append(const char *str, size_t len, const coltext::limits &bounds) const
+{
+    COLTEXT_TIMED();
+    [[maybe_unused]] size_t capacity = this->colored_str.capacity();
+
+    machine parser(this->config.compact, this->config.colors, bounds, this->get_allocator());
+    if (this->state) parser = *this->state;
+    parser.measure_columns(true);
+
+    this->colored_str.resize(this->colored_str.size() - this->closing);
+    this->columns -= this->closing_columns;
+    this->points.reset();
+
+    size_t before = parser.columns();
+    coltext::detail::string_sink<string_type> sink{this->colored_str};
+    coltext::detail::feed(parser, str, len, sink, this->config.plain);
+    this->columns += parser.columns() - before;
+    COLTEXT_COUNT(allocations, this->colored_str.capacity() != capacity);
+
+    if (parser.neutral())
+    {// Nothing to close
+        this->state.reset();
+        this->closing = 0;
+        this->closing_columns = 0;
+        return;
+    }
+
+    size_t size = this->colored_str.size();
+    before = parser.columns();
+    this->save(parser);
+    coltext::detail::finish(parser, sink, this->config.plain);
+    this->closing = this->colored_str.size() - size;
+
+    // Tag left unfinished is closed as text
+    this->closing_columns = parser.columns() - before;
+    this->columns += this->closing_columns;
+}
+
+/* Keeps copy of parser in memory of this Coltext. */
+template <class Alloc>
+COLTEXT_INLINE void basic_coltext<Alloc>::save(const machine &parser) const
+{
+    auto copy = std::allocate_shared<machine>(this->get_allocator(), false, this->get_allocator());
+    COLTEXT_COUNT(allocations, 1);
+    *copy = parser;
+    this->state = std::move(copy);
+}
+
+template <class Alloc>
+COLTEXT_INLINE void basic_coltext<Alloc>::share_state(const basic_coltext &other)
+{
+    if (other.state && other.get_allocator() != this->get_allocator()) this->save(*other.state);
+    else this->state = other.state;
+
+    // Index is made again by the first slice
+    if (other.get_allocator() == this->get_allocator()) this->points.store(other.points.load());
+    else this->points.reset();
+}
+
+template <class Alloc>
+COLTEXT_INLINE std::istream & operator>> (std::istream &is, basic_coltext<Alloc> &ctxt)
+{
+    std::string str; std::getline(is, str);
+
+    ctxt = basic_coltext<Alloc>(std::string_view(str), ctxt.get_allocator());
+    
+    return is;
+}
+
+template <class Alloc>
+COLTEXT_INLINE std::ostream & operator<< (std::ostream &os, const basic_coltext<Alloc> &ctxt)
+{
+    auto config = coltext::detail::config_for(os);
+    if (ctxt.rendered && (ctxt.config == config || !ctxt.source)) return os << ctxt.colored_str;
+
+    std::ostream::sentry sentry(os);
+    if (!sentry) return os;
+    COLTEXT_TIMED();
+
+    coltext::detail::streambuf_sink sink{os.rdbuf()};
+    coltext::detail::basic_machine<Alloc> parser(config.compact, config.colors, coltext::get_limits(), ctxt.get_allocator());
+    coltext::detail::feed(parser, ctxt.str.c_str(), ctxt.str.size(), sink, config.plain);
+    coltext::detail::finish(parser, sink, config.plain);
+
+    if (!sink.good) os.setstate(std::ios_base::badbit);
+    os.width(0);
+    return os;
+}
+
+#ifndef COLTEXT_STATIC_LITERALS
+inline Coltext literals::operator"" _col(const char *str, size_t len)
+{
+    return Coltext(str, len);
+}
+#endif
+
+#if defined(COLTEXT_SEPARATE_COMPILATION)
+/* Instantiated once in coltext.cpp. */
+extern template class basic_coltext<std::allocator<char>>;
+extern template std::istream & operator>> (std::istream &, Coltext &);
+extern template std::ostream & operator<< (std::ostream &, const Coltext &);
+#endif
+
+namespace coltext {
+
+/**
+ * @class streambuf
+ * @brief:
+ *  Parses Coltext markup as it's written and forwards 
+ *  rendered text to another stream buffer. Memory used does
+ *  not depend on text size, tags and escapes may be split 
+ *  between writes. Open effects are closed by finish().
+ */
+class streambuf : public std::streambuf {
+public:
+    explicit streambuf(std::streambuf *dest, render_mode mode = get_render_mode(),
+                       bool compact = get_compact_escapes(), color_depth colors = get_color_depth())
+    : dest(dest),
+      parser(compact, colors, get_limits()),
+      plain(detail::is_plain(mode, dest))
+    {
+        this->setp(this->buffer, this->buffer + sizeof(this->buffer));
+    }
+
+    streambuf(const streambuf &) = delete;
+    streambuf & operator= (const streambuf &) = delete;
+
+    ~streambuf() override { this->finish(); }
+
+    /* Closes open effects. Next markup starts from scratch. */
+    void finish()
+    {
+        this->parse_buffer();
+        detail::streambuf_sink sink{this->dest};
+        detail::finish(this->parser, sink, this->plain);
+        this->good = this->good && sink.good;
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!this->parse_buffer()) return traits_type::eof();
+        if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+
+        *this->pptr() = traits_type::to_char_type(ch);
+        this->pbump(1);
+        return ch;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        if (n <= this->epptr() - this->pptr())
+        {// Small writes are gathered in buffer
+            traits_type::copy(this->pptr(), s, (size_t)n);
+            this->pbump((int)n);
+            return n;
+        }
+
+        if (!this->parse_buffer()) return 0;
+        return this->parse(s, (size_t)n) ? n : 0;
+    }
+
+    int sync() override
+    {
+        if (!this->parse_buffer()) return -1;
+        return this->dest->pubsync();
+    }
+
+private:
+    bool parse(const char *s, size_t n)
+    {
+        COLTEXT_TIMED();
+        detail::streambuf_sink sink{this->dest};
+        detail::feed(this->parser, s, n, sink, this->plain);
+        this->good = this->good && sink.good;
+        return this->good;
+    }
+
+    bool parse_buffer()
+    {
+        size_t n = (size_t)(this->pptr() - this->pbase());
+        this->setp(this->buffer, this->buffer + sizeof(this->buffer));
+        return this->parse(this->buffer, n);
+    }
+
+    std::streambuf *dest;
+    detail::machine parser;
+    bool plain;
+    bool good = true;
+
+    char buffer[1024];
+};
+
+/**
+ * @class ostream
+ * @brief:
+ *  Output stream colorizing Coltext markup on the fly. 
+ *  Example: coltext::ostream out(std::cout); out << "#g(OK)";
+ */
+class ostream : public std::ostream {
+public:
+    explicit ostream(std::streambuf *dest, render_mode mode = get_render_mode(),
+                     bool compact = get_compact_escapes(), color_depth colors = get_color_depth())
+    : std::ostream(nullptr),
+      buf(dest, mode, compact, colors)
+    {
+        this->rdbuf(&this->buf);
+    }
+
+    /* Uses the render mode, compact escapes and color depth of os. */
+    explicit ostream(std::ostream &os)
+    : ostream(os.rdbuf(), get_render_mode(os), get_compact_escapes(os), get_color_depth(os))
+    {}
+
+    /* Closes open effects. Next markup starts from scratch. */
+    void finish() { this->flush(); this->buf.finish(); }
+
+private:
+    coltext::streambuf buf;
+};
+
+/**
+ * @class parser
+ * @brief:
+ *  Push parser of markup that comes in chunks, e.g. socket reads
+ *  or lines of a file. State is kept between feed() calls, so 
+ *  effects, tags and '\\' may be split anywhere and rendered chunks
+ *  put together are the same as the markup rendered at once.
+ *  Returned text is valid until the next call, its buffer is
+ *  reused, so feeding allocates nothing once it's grown.
+ *  Example:
+ *      coltext::parser p;
+ *      while (std::getline(is, line)) std::cout << p.feed(line += '\n');
+ *      std::cout << p.finish();
+ */
+class parser {
+public:
+    explicit parser(render_mode mode = get_render_mode(), bool compact = get_compact_escapes(),
+                    color_depth colors = get_color_depth(), const limits &bounds = get_limits())
+    : state(compact, colors, bounds),
+      plain(detail::is_plain(mode, detail::stdout_buf()))
+    {}
+
+    /* Text of markup rendered so far, effects left open stay open. */
+    std::string_view feed(std::string_view markup)
+    {
+        COLTEXT_TIMED();
+        this->out.clear();
+        detail::string_sink<std::string> sink{this->out};
+        detail::feed(this->state, markup.data(), markup.size(), sink, this->plain);
+        return this->out;
+    }
+
+    /* Closes open effects. Next markup starts from scratch. */
+    std::string_view finish()
+    {
+        COLTEXT_TIMED();
+        this->out.clear();
+        detail::string_sink<std::string> sink{this->out};
+        detail::finish(this->state, sink, this->plain);
+        return this->out;
+    }
+
+    /* Whether finish() would write nothing. */
+    bool neutral() const noexcept { return this->state.neutral(); }
+
+private:
+    detail::machine state;
+    bool plain;
+    std::string out;
+};
+
+namespace detail {
+
+inline void append_value(std::string &out, std::string_view value) { out.append(value.data(), value.size()); }
+inline void append_value(std::string &out, const char *value) { out.append(value); }
+inline void append_value(std::string &out, char value) { out.push_back(value); }
+inline void append_value(std::string &out, bool value) { out.append(value ? "true" : "false"); }
+
+template <class T>
+inline std::enable_if_t<std::is_arithmetic_v<T>> append_value(std::string &out, T value)
+{
+    char buf[64];
+    auto result = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, (std::size_t)(result.ptr - buf));
+}
+
+} // namespace detail
+
+/**
+ * @class compiled_template
+ * @brief:
+ *  Markup with holes "{}", parsed once. "{{" and "}}" are braces.
+ *  format() only copies rendered parts and values between them,
+ *  values are never parsed, so they can't change effects.
+ *  Example: 
+ *      coltext::compiled_template done("#g(OK) #b({}) took #y({}) ms");
+ *      std::cout << done.format(name, 42);
+ *  Holes inside tags are text. Values are strings, chars, bool
+ *  and numbers; holes with no value are left empty.
+ */
+class compiled_template {
+public:
+    explicit compiled_template(std::string_view markup, render_mode mode = get_render_mode(),
+                               bool compact = get_compact_escapes(), color_depth colors = get_color_depth())
+    {
+        COLTEXT_TIMED();
+        detail::string_sink<std::string> sink{this->parts};
+        detail::machine parser(compact, colors, get_limits());
+        bool plain = detail::is_plain(mode, detail::stdout_buf());
+
+        std::size_t begin = 0; // Of text not parsed yet
+        for (std::size_t i = 0; i + 1 < markup.size(); ++i)
+        {
+            char c = markup[i], next = markup[i + 1];
+            if (c != '{' && c != '}') continue;
+            if (c == '}' && next != '}') continue;
+            if (c == '{' && next != '{' && next != '}') continue;
+
+            // Brace is kept, the second one is skipped
+            bool hole = (c == '{' && next == '}');
+            detail::feed(parser, markup.data() + begin, i + (hole ? 0 : 1) - begin, sink, plain);
+            begin = i + 2;
+            ++i;
+
+            if (!hole) continue;
+            if (!parser.in_text())
+            {
+                detail::feed(parser, "{}", 2, sink, plain);
+                continue;
+            }
+
+            if (!plain) parser.sync(sink);
+            this->ends.push_back(this->parts.size());
+        }
+
+        detail::feed(parser, markup.data() + begin, markup.size() - begin, sink, plain);
+        detail::finish(parser, sink, plain);
+        this->ends.push_back(this->parts.size());
+    }
+
+    std::size_t holes() const noexcept { return this->ends.size() - 1; }
+
+    template <class... Args>
+    std::string format(const Args &... args) const
+    {
+        std::string out;
+        this->format_to(out, args...);
+        return out;
+    }
+
+    /* Appends to out, so its memory may be reused. */
+    template <class... Args>
+    void format_to(std::string &out, const Args &... args) const
+    {
+        out.reserve(out.size() + this->parts.size() + 16 * sizeof...(Args));
+
+        std::size_t hole = 0;
+        this->append_part(out, hole);
+
+        auto put = [&](const auto &arg) {
+            if (hole >= this->holes()) return;
+            detail::append_value(out, arg);
+            this->append_part(out, ++hole);
+        };
+        (put(args), ...);
+        (void)put;
+
+        while (hole < this->holes()) this->append_part(out, ++hole);
+    }
+
+private:
+    void append_part(std::string &out, std::size_t i) const
+    {
+        std::size_t begin = i == 0 ? 0 : this->ends[i - 1];
+        out.append(this->parts, begin, this->ends[i] - begin);
+    }
+
+    std::string parts;             // Rendered text between holes
+    std::vector<std::size_t> ends; // End of each part in parts
+};
+
+} // namespace coltext
+
 #endif // COLTEXT_HPP
\ No newline at end of file
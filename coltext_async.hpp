@@ -0,0 +1,306 @@
+// Coltext asynchronous log.
+
+// Copyright (C) 2020 by Earl H. (1410rlH)
+//
+// Takes markup from many threads into a lock-free ring and
+// renders and writes it on a background thread, so callers
+// pay for a copy instead of parsing and terminal output.
+
+//
+// Distributed by the terms of GPL.
+// See LICENSE for details.
+//
+
+#ifndef COLTEXT_ASYNC_HPP
+#define COLTEXT_ASYNC_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "coltext.hpp"
+
+namespace coltext {
+
+/**
+ * @enum class overflow
+ * @brief:
+ *  What push() does when the ring is full:
+ *      block - waits for the writer to free a slot;
+ *      drop  - drops the message;
+ *      count - drops the message, the writer reports
+ *              "[N messages dropped]" before the next one.
+ */
+enum class overflow : unsigned char {
+    block, drop, count
+};
+
+namespace detail {
+
+/* Appends text with its SGR escapes removed. */
+inline void append_plain(std::string &out, std::string_view text)
+{
+    for (std::size_t i = 0; i < text.size(); )
+    {
+        if (std::size_t n = sgr_size(text.data() + i, text.size() - i)) { i += n; continue; }
+
+        std::size_t begin = i;
+        while (++i < text.size() && text[i] != '\033') {}
+        out.append(text.data() + begin, i - begin);
+    }
+}
+
+} // namespace detail
+
+struct async_options {
+    std::size_t capacity = 4096; // Messages, rounded up to a power of two
+    overflow    policy   = overflow::block;
+    render_mode mode     = get_render_mode();
+    bool        compact  = get_compact_escapes();
+    color_depth colors   = get_color_depth();
+    limits      bounds   = get_limits();
+};
+
+/**
+ * @class async_log
+ * @brief:
+ *  Messages pushed from any thread are kept in a bounded ring
+ *  (one CAS and a copy into reused memory) and rendered and
+ *  written in batches by one background thread, in the order
+ *  their slots were taken. Messages are written as they are,
+ *  end them with '\n'. Destructor writes everything pushed,
+ *  so a static log is flushed when the program exits.
+ *  Example:
+ *      static coltext::async_log log(std::cerr);
+ *      log.push("#r(error:) disk is full\n");
+ *      log.push(done, name, 42); // compiled_template, not parsed again
+ */
+class async_log {
+public:
+    explicit async_log(std::ostream &os, const async_options &options = {})
+    : os(os),
+      policy(options.policy),
+      plain(detail::is_plain(options.mode, os.rdbuf())),
+      parser(options.compact, options.colors, options.bounds)
+    {
+        std::size_t capacity = 2;
+        while (capacity < options.capacity) capacity *= 2;
+
+        this->mask  = capacity - 1;
+        this->slots = std::make_unique<slot[]>(capacity);
+        for (std::size_t i = 0; i < capacity; ++i) this->slots[i].seq.store(i, std::memory_order_relaxed);
+
+        this->writer = std::thread([this] { this->run(); });
+    }
+
+    async_log(const async_log &) = delete;
+    async_log & operator= (const async_log &) = delete;
+
+    ~async_log()
+    {
+        this->stopping.store(true, std::memory_order_release);
+        this->wake();
+        this->writer.join();
+    }
+
+    /* Markup to render, false if it's dropped. */
+    bool push(std::string_view markup)
+    {
+        return this->put([markup](std::string &text) { text.assign(markup.data(), markup.size()); }, false);
+    }
+
+    /* Values spliced into template, written without parsing. Escapes are 
+       removed for a plain log, otherwise they are written as the template
+       was compiled: compile it with the compact escapes and colors of the log. */
+    template <class... Args>
+    bool push(const compiled_template &tmpl, const Args &... args)
+    {
+        return this->put([&](std::string &text) { text.clear(); tmpl.format_to(text, args...); }, true);
+    }
+
+    /* Waits until everything pushed before is written. */
+    void flush()
+    {
+        std::uint64_t target = this->tail.load(std::memory_order_acquire);
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        ++this->flushing;
+        this->wakeup.notify_one();
+        this->done.wait(lock, [&] { return this->written.load(std::memory_order_acquire) >= target; });
+        --this->flushing;
+    }
+
+    std::uint64_t dropped() const noexcept { return this->lost.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) slot {
+        std::atomic<std::uint64_t> seq{0}; // Position it waits for, + 1 when filled
+        std::string text;
+        bool rendered = false;
+    };
+
+    template <class Fill>
+    bool put(const Fill &fill, bool rendered)
+    {
+        std::uint64_t pos = this->tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            slot &s = this->slots[pos & this->mask];
+            std::uint64_t seq = s.seq.load(std::memory_order_acquire);
+
+            if (seq == pos)
+            {
+                if (!this->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) continue;
+
+                fill(s.text);
+                s.rendered = rendered;
+                s.seq.store(pos + 1, std::memory_order_release);
+
+                // Pairs with the fence of writer going to sleep
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (this->sleeping.load(std::memory_order_relaxed)) this->wake();
+                return true;
+            }
+
+            if (seq < pos) // Full
+            {
+                if (this->policy != overflow::block)
+                {
+                    this->lost.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (this->sleeping.load(std::memory_order_relaxed)) this->wake();
+                std::this_thread::yield();
+            }
+            pos = this->tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->wakeup.notify_one();
+    }
+
+    bool ready() const noexcept
+    {
+        return this->slots[this->head & this->mask].seq.load(std::memory_order_acquire) == this->head + 1;
+    }
+
+    /* Renders messages in the ring into batch, at most about 64KB. */
+    std::size_t take()
+    {
+        std::size_t count = 0;
+        detail::string_sink<std::string> sink{this->batch};
+
+        while (this->batch.size() < 64 * 1024)
+        {
+            if (this->policy == overflow::count)
+            {
+                std::uint64_t lost = this->lost.load(std::memory_order_relaxed);
+                if (lost != this->reported)
+                {
+                    this->batch += '[' + std::to_string(lost - this->reported) + " messages dropped]\n";
+                    this->reported = lost;
+                }
+            }
+            if (!this->ready()) break;
+
+            slot &s = this->slots[this->head & this->mask];
+            if (s.rendered && this->plain) detail::append_plain(this->batch, s.text);
+            else if (s.rendered) this->batch += s.text;
+            else
+            {
+                COLTEXT_TIMED();
+                detail::feed(this->parser, s.text.data(), s.text.size(), sink, this->plain);
+                detail::finish(this->parser, sink, this->plain);
+            }
+
+            s.seq.store(this->head + this->mask + 1, std::memory_order_release);
+            ++this->head;
+            ++count;
+        }
+        return count;
+    }
+
+    /* Waits a little for messages before going to sleep,
+       so busy producers rarely have to wake the writer. */
+    bool idle() const
+    {
+        auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+        do {
+            std::this_thread::yield();
+            if (this->ready()) return true;
+        } while (std::chrono::steady_clock::now() < until);
+        return false;
+    }
+
+    void run()
+    {
+        for (;;)
+        {
+            std::size_t count = this->take();
+            if (!this->batch.empty())
+            {
+                this->os.write(this->batch.data(), (std::streamsize)this->batch.size());
+                this->os.flush();
+                this->batch.clear();
+
+                this->written.fetch_add(count, std::memory_order_release);
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if (this->flushing) this->done.notify_all();
+                continue;
+            }
+
+            if (this->stopping.load(std::memory_order_acquire)) return;
+            if (this->idle()) continue;
+
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!this->ready() && !this->stopping.load(std::memory_order_relaxed))
+            {
+                this->wakeup.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            this->sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    std::ostream &os;
+    overflow policy;
+    bool plain;
+
+    std::unique_ptr<slot[]> slots;
+    std::uint64_t mask = 0;
+
+    alignas(64) std::atomic<std::uint64_t> tail{0}; // Next slot to take
+    alignas(64) std::atomic<std::uint64_t> lost{0};
+    std::atomic<bool> sleeping{false};
+
+    // Writer side
+    alignas(64) std::uint64_t head = 0; // Next slot to write
+    std::uint64_t reported = 0;         // Dropped messages already reported
+    std::atomic<std::uint64_t> written{0};
+    std::atomic<bool> stopping{false};
+    detail::machine parser;
+    std::string batch;
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable done;
+    unsigned flushing = 0;
+
+    std::thread writer;
+};
+
+} // namespace coltext
+
+#endif // COLTEXT_ASYNC_HPP
@@ -0,0 +1,186 @@
+// Coltext batch rendering.
+
+// Copyright (C) 2020 by Earl H. (1410rlH)
+//
+// Renders many lines of Coltext markup on all cores
+// into one buffer, keeping the order of lines.
+
+//
+// Distributed by the terms of GPL.
+// See LICENSE for details.
+//
+
+#ifndef COLTEXT_BATCH_HPP
+#define COLTEXT_BATCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "coltext.hpp"
+
+namespace coltext {
+
+struct batch_options {
+    unsigned    threads = 0; // All cores if 0
+    render_mode mode    = get_render_mode();
+    bool        compact = get_compact_escapes();
+    color_depth colors  = get_color_depth();
+    limits      bounds  = get_limits();
+};
+
+/**
+ * @struct batch_result
+ * @brief:
+ *  Rendered lines one after another in a single buffer.
+ *  Line i is text[offsets[i], offsets[i + 1]).
+ */
+struct batch_result {
+    std::string text;
+    std::vector<std::size_t> offsets{0};
+
+    std::size_t size() const noexcept { return offsets.size() - 1; }
+
+    std::string_view operator[] (std::size_t i) const noexcept
+    {
+        return std::string_view(text).substr(offsets[i], offsets[i + 1] - offsets[i]);
+    }
+};
+
+namespace detail {
+
+/* Lines rendered by one task, offsets are relative to its text. */
+struct batch_chunk {
+    std::size_t begin = 0; // First line
+    std::size_t end   = 0; // Past the last line
+    std::string text;
+    std::vector<std::size_t> ends;
+};
+
+/* Calls task(i) for every i in [0, count). Threads take next task
+   as soon as they are done, so slow tasks don't hold others. */
+template <class Task>
+void parallel_for(std::size_t count, unsigned threads, const Task &task)
+{
+    threads = (unsigned)std::min<std::size_t>(threads, count);
+    if (threads <= 1)
+    {
+        for (std::size_t i = 0; i < count; ++i) task(i);
+        return;
+    }
+
+    std::atomic<std::size_t> next{0};
+    std::vector<std::exception_ptr> errors(threads);
+
+    auto work = [&](unsigned id) {
+        try {
+            for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count; ) task(i);
+        } catch (...) {
+            errors[id] = std::current_exception();
+            next.store(count, std::memory_order_relaxed);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned id = 1; id < threads; ++id) pool.emplace_back(work, id);
+    work(0);
+    for (auto &thread : pool) thread.join();
+
+    for (auto &error : errors) if (error) std::rethrow_exception(error);
+}
+
+inline batch_result render_batch(const std::vector<std::string_view> &lines, const batch_options &options)
+{
+    // Chunks of about 64KB keep threads busy and tasks cheap to take
+    constexpr std::size_t chunk_bytes = 64 * 1024;
+    constexpr std::size_t chunk_lines = 4096;
+
+    std::vector<batch_chunk> chunks;
+    for (std::size_t i = 0, bytes = 0; i < lines.size(); ++i)
+    {
+        if (chunks.empty() || bytes >= chunk_bytes || i - chunks.back().begin >= chunk_lines)
+        {
+            if (!chunks.empty()) chunks.back().end = i;
+            chunks.push_back({i, i, {}, {}});
+            bytes = 0;
+        }
+        bytes += lines[i].size();
+    }
+    if (!chunks.empty()) chunks.back().end = lines.size();
+
+    unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    bool plain = is_plain(options.mode, stdout_buf());
+
+    parallel_for(chunks.size(), threads, [&](std::size_t c) {
+        COLTEXT_TIMED();
+        batch_chunk &chunk = chunks[c];
+        string_sink<std::string> sink{chunk.text};
+        machine parser(options.compact, options.colors, options.bounds);
+
+        std::size_t bytes = 0;
+        for (std::size_t i = chunk.begin; i < chunk.end; ++i) bytes += lines[i].size();
+        chunk.text.reserve(bytes + bytes / 4 + 16);
+        chunk.ends.reserve(chunk.end - chunk.begin);
+
+        for (std::size_t i = chunk.begin; i < chunk.end; ++i)
+        {
+            feed(parser, lines[i].data(), lines[i].size(), sink, plain);
+            finish(parser, sink, plain);
+            chunk.ends.push_back(chunk.text.size());
+        }
+    });
+
+    batch_result result;
+    result.offsets.resize(lines.size() + 1);
+
+    std::vector<std::size_t> base(chunks.size() + 1, 0);
+    for (std::size_t c = 0; c < chunks.size(); ++c) base[c + 1] = base[c] + chunks[c].text.size();
+    result.text.resize(base.back());
+
+    parallel_for(chunks.size(), threads, [&](std::size_t c) {
+        batch_chunk &chunk = chunks[c];
+        chunk.text.copy(&result.text[base[c]], chunk.text.size());
+        for (std::size_t i = chunk.begin; i < chunk.end; ++i)
+        {
+            result.offsets[i + 1] = base[c] + chunk.ends[i - chunk.begin];
+        }
+        std::string().swap(chunk.text);
+    });
+    return result;
+}
+
+} // namespace detail
+
+/* Renders every string of range as a separate Coltext. */
+template <class Range>
+batch_result render_batch(const Range &range, const batch_options &options = {})
+{
+    std::vector<std::string_view> lines;
+    for (const auto &str : range) lines.emplace_back(str);
+    return detail::render_batch(lines, options);
+}
+
+/* Renders every line of buffer, '\n' are not kept. */
+inline batch_result render_lines(std::string_view buffer, const batch_options &options = {})
+{
+    std::vector<std::string_view> lines;
+    std::size_t begin = 0;
+    while (begin < buffer.size())
+    {
+        std::size_t end = buffer.find('\n', begin);
+        if (end == std::string_view::npos) end = buffer.size();
+
+        lines.push_back(buffer.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return detail::render_batch(lines, options);
+}
+
+} // namespace coltext
+
+#endif // COLTEXT_BATCH_HPP
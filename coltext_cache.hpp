@@ -0,0 +1,223 @@
+// Coltext render cache.
+
+// Copyright (C) 2020 by Earl H. (1410rlH)
+//
+// Keeps rendered Coltext of repeated markup, so building
+// it again costs a hash and a copy instead of parsing.
+
+//
+// Distributed by the terms of GPL.
+// See LICENSE for details.
+//
+
+#ifndef COLTEXT_CACHE_HPP
+#define COLTEXT_CACHE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "coltext.hpp"
+
+namespace coltext {
+
+/**
+ * @class render_cache
+ * @brief:
+ *  Bounded cache of rendered Coltext, safe to use from many threads.
+ *  Markup is spread over shards by hash, lookups of a shard share
+ *  its lock. When a shard is full, entries not used since the
+ *  last sweep are dropped first (CLOCK).
+ *  Example:
+ *      static coltext::render_cache cache;
+ *      std::cout << cache.get("#g([ OK ])");
+ */
+class render_cache {
+public:
+    struct counters {
+        std::uint64_t hits      = 0;
+        std::uint64_t misses    = 0;
+        std::uint64_t evictions = 0;
+        std::size_t   entries   = 0;
+        std::size_t   bytes     = 0; // Markup and rendered text
+    };
+
+    /* Markup longer than max_bytes / shards is never kept. */
+    explicit render_cache(std::size_t max_bytes = 1 << 20, std::size_t count = 16)
+    : shard_bytes(max_bytes / (count ? count : 1)),
+      shards(count ? count : 1)
+    {}
+
+    render_cache(const render_cache &) = delete;
+    render_cache & operator= (const render_cache &) = delete;
+
+    /* Coltext of markup rendered in the current render mode and limits.
+       They are taken once, so text is stored under the settings it has
+       even if other threads change them meanwhile. */
+    Coltext get(std::string_view markup)
+    {
+        key config{detail::config_for(), get_limits()};
+        std::size_t hash = hash_of(markup, config);
+        shard &s = this->shards[(hash >> 8) % this->shards.size()];
+
+        {
+            std::shared_lock<std::shared_mutex> lock(s.mutex);
+            if (const entry *e = s.find(hash, markup, config))
+            {
+                e->used.store(true, std::memory_order_relaxed);
+                s.hits.fetch_add(1, std::memory_order_relaxed);
+                return e->text;
+            }
+        }
+
+        s.misses.fetch_add(1, std::memory_order_relaxed);
+        Coltext text(markup.data(), markup.size(), coltext::lazy);
+        text.render(config.config, config.bounds);
+
+        std::size_t cost = 2 * markup.size() + text.colored().size() + sizeof(entry);
+        if (cost > this->shard_bytes) return text;
+
+        std::unique_lock<std::shared_mutex> lock(s.mutex);
+        if (s.find(hash, markup, config)) return text; // Added by other thread
+
+        while (s.bytes + cost > this->shard_bytes) s.evict();
+
+        auto e = std::make_unique<entry>(std::string(markup), config, text, cost);
+        s.ring.push_back(e.get());
+        s.table.emplace(hash, std::move(e));
+        s.bytes += cost;
+        return text;
+    }
+
+    counters stats() const
+    {
+        counters total;
+        for (const shard &s : this->shards)
+        {
+            std::shared_lock<std::shared_mutex> lock(s.mutex);
+            total.hits      += s.hits.load(std::memory_order_relaxed);
+            total.misses    += s.misses.load(std::memory_order_relaxed);
+            total.evictions += s.evictions.load(std::memory_order_relaxed);
+            total.entries   += s.table.size();
+            total.bytes     += s.bytes;
+        }
+        return total;
+    }
+
+    void clear()
+    {
+        for (shard &s : this->shards)
+        {
+            std::unique_lock<std::shared_mutex> lock(s.mutex);
+            s.table.clear();
+            s.ring.clear();
+            s.hand  = 0;
+            s.bytes = 0;
+        }
+    }
+
+private:
+    /* What text is rendered with besides markup. */
+    struct key {
+        detail::render_config config;
+        limits bounds;
+
+        bool operator== (const key &other) const noexcept
+        {
+            return config == other.config &&
+                   bounds.max_depth     == other.bounds.max_depth &&
+                   bounds.max_tag_size  == other.bounds.max_tag_size &&
+                   bounds.max_expansion == other.bounds.max_expansion;
+        }
+    };
+
+    static std::size_t hash_of(std::string_view markup, const key &config) noexcept
+    {
+        std::size_t h = config.config.plain + 2u * config.config.compact + 4u * (unsigned)config.config.colors;
+        for (std::size_t v : {config.bounds.max_depth, config.bounds.max_tag_size, config.bounds.max_expansion})
+        {
+            h = h * 31 + v;
+        }
+        return std::hash<std::string_view>()(markup) ^ h;
+    }
+
+    struct entry {
+        entry(std::string markup, const key &config, const Coltext &text, std::size_t cost)
+        : markup(std::move(markup)),
+          config(config),
+          text(text),
+          cost(cost)
+        {}
+
+        std::string markup;
+        key config;
+        Coltext text;
+        std::size_t cost;
+        mutable std::atomic<bool> used{false};
+    };
+
+    struct alignas(64) shard {
+        const entry * find(std::size_t hash, std::string_view markup, const key &config) const
+        {
+            auto range = this->table.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                const entry &e = *it->second;
+                if (e.config == config && e.markup == markup) return &e;
+            }
+            return nullptr;
+        }
+
+        /* Drops the first entry not used since the hand passed it. */
+        void evict()
+        {
+            for (;;)
+            {
+                if (this->hand >= this->ring.size()) this->hand = 0;
+
+                entry *e = this->ring[this->hand];
+                if (e->used.exchange(false, std::memory_order_relaxed))
+                {
+                    ++this->hand;
+                    continue;
+                }
+
+                this->ring[this->hand] = this->ring.back();
+                this->ring.pop_back();
+                this->bytes -= e->cost;
+                this->evictions.fetch_add(1, std::memory_order_relaxed);
+
+                auto range = this->table.equal_range(hash_of(e->markup, e->config));
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    if (it->second.get() == e) { this->table.erase(it); break; }
+                }
+                return;
+            }
+        }
+
+        mutable std::shared_mutex mutex;
+        std::unordered_multimap<std::size_t, std::unique_ptr<entry>> table;
+        std::vector<entry *> ring; // Clock order
+        std::size_t hand  = 0;
+        std::size_t bytes = 0;
+
+        std::atomic<std::uint64_t> hits{0};
+        std::atomic<std::uint64_t> misses{0};
+        std::atomic<std::uint64_t> evictions{0};
+    };
+
+    std::size_t shard_bytes;
+    std::vector<shard> shards;
+};
+
+} // namespace coltext
+
+#endif // COLTEXT_CACHE_HPP
@@ -0,0 +1,211 @@
+// Coltext style spans.
+
+// Copyright (C) 2020 by Earl H. (1410rlH)
+//
+// Parses Coltext markup once into plain text and runs of
+// style over it, so the same message may be printed to a
+// terminal, a web page and a log file without parsing again.
+
+//
+// Distributed by the terms of GPL.
+// See LICENSE for details.
+//
+
+#ifndef COLTEXT_SPANS_HPP
+#define COLTEXT_SPANS_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "coltext.hpp"
+
+namespace coltext {
+
+/* Run of text with one style. */
+struct span {
+    std::size_t offset = 0; // In plain text
+    std::size_t length = 0;
+    coltext::style style;
+};
+
+namespace detail {
+
+/* Sink of compact machine, adds text to plain and its style to spans. */
+struct span_sink {
+    static constexpr bool effects = true;
+    static constexpr bool styles  = true;
+
+    std::string &plain;
+    std::vector<span> &spans;
+    coltext::style current;
+
+    void set_style(const coltext::style &s) { current = s; }
+
+    void text(const char *s, std::size_t len)
+    {
+        if (!spans.empty() && spans.back().style == current) spans.back().length += len;
+        else spans.push_back({plain.size(), len, current});
+        plain.append(s, len);
+    }
+
+    void effect(const code &) {}
+};
+
+/* RGB of color as xterm shows it, false for default color. */
+inline bool color_rgb(const code &c, unsigned rgb[3])
+{
+    using ansi::Effect;
+
+    unsigned e = (unsigned)c.effect;
+    if (ansi::is_rgb(c.effect))
+    {
+        if (c.indexed) xterm_rgb(c.r, rgb);
+        else { rgb[0] = c.r; rgb[1] = c.g; rgb[2] = c.b; }
+        return true;
+    }
+
+    unsigned index;
+    if      (ansi::is_fg(c.effect) && e < (unsigned)Effect::bright_black_fg) index = e - (unsigned)Effect::black_fg;
+    else if (ansi::is_fg(c.effect)) index = 8 + e - (unsigned)Effect::bright_black_fg;
+    else if (ansi::is_bg(c.effect) && e < (unsigned)Effect::bright_black_bg) index = e - (unsigned)Effect::black_bg;
+    else if (ansi::is_bg(c.effect)) index = 8 + e - (unsigned)Effect::bright_black_bg;
+    else return false;
+
+    xterm_rgb(index, rgb);
+    return true;
+}
+
+inline void append_css_color(std::string &css, const char *property, const code &c)
+{
+    unsigned rgb[3];
+    if (!color_rgb(c, rgb)) return;
+
+    const char *hex = "0123456789abcdef";
+    css += property;
+    css += ":#";
+    for (unsigned v : rgb) { css += hex[v >> 4]; css += hex[v & 15]; }
+    css += ';';
+}
+
+/* CSS declarations of style, empty for default one. */
+inline std::string css_of(const style &s)
+{
+    std::string css;
+
+    bool reverse = s.attrs & style::reverse;
+    append_css_color(css, "color",            reverse ? s.bg : s.fg);
+    append_css_color(css, "background-color", reverse ? s.fg : s.bg);
+
+    if (s.attrs & style::bold)   css += "font-weight:bold;";
+    if (s.attrs & style::faint)  css += "opacity:0.5;";
+    if (s.attrs & style::italic) css += "font-style:italic;";
+
+    std::string lines;
+    if (s.underline)                  lines += " underline";
+    if (s.attrs & style::crossed)     lines += " line-through";
+    if (s.attrs & style::overlined)   lines += " overline";
+    if (!lines.empty())               css += "text-decoration:" + lines.substr(1) + ';';
+    if (s.underline == 2)             css += "text-decoration-style:double;";
+
+    if (s.frame)      css += "border:1px solid;";
+    if (s.frame == 2) css += "border-radius:0.5em;";
+    return css;
+}
+
+inline void append_html_escaped(std::string &html, std::string_view text)
+{
+    for (char c : text)
+    {
+        switch (c) {
+        case '&':  html += "&amp;";  break;
+        case '<':  html += "&lt;";   break;
+        case '>':  html += "&gt;";   break;
+        case '"':  html += "&quot;"; break;
+        case '\'': html += "&#39;";  break;
+        default:   html += c;
+        }
+    }
+}
+
+} // namespace detail
+
+/**
+ * @class styled_text
+ * @brief:
+ *  Markup parsed once into plain text and spans of style
+ *  covering it. Spans next to each other have different styles.
+ *  Rendered by any backend without parsing again:
+ *      text()  - plain text, for log files;
+ *      ansi()  - text with escapes, for terminals;
+ *      html()  - text in <span style="..."> tags, for web pages;
+ *      visit() - calls f(std::string_view text, const style &)
+ *                for every span.
+ *  Example:
+ *      coltext::styled_text msg("#r(error:) <b>(disk) is full");
+ *      log << msg.text(); std::cout << msg.ansi(); page << msg.html();
+ */
+class styled_text {
+public:
+    explicit styled_text(std::string_view markup, const limits &bounds = get_limits())
+    {
+        COLTEXT_TIMED();
+        detail::span_sink sink{this->plain, this->runs, {}};
+        detail::machine parser(true, color_depth::truecolor, bounds);
+        parser.feed(markup.data(), markup.size(), sink);
+        parser.finish(sink);
+    }
+
+    const std::string &       text()  const noexcept { return this->plain; }
+    const std::vector<span> & spans() const noexcept { return this->runs; }
+
+    template <class Visitor>
+    void visit(Visitor &&f) const
+    {
+        for (const span &s : this->runs) f(std::string_view(this->plain).substr(s.offset, s.length), s.style);
+    }
+
+    /* Text with compact escapes, rgb colors shown with given colors. */
+    std::string ansi(color_depth colors = color_depth::truecolor) const
+    {
+        std::string out;
+        detail::string_sink<std::string> sink{out};
+        out.reserve(this->plain.size() + this->runs.size() * 8);
+
+        style shown;
+        this->visit([&](std::string_view text, style s) {
+            s.fg = detail::downsample(s.fg, colors);
+            s.bg = detail::downsample(s.bg, colors);
+            if (s != shown) detail::write_style(shown, s, sink);
+            out += text;
+            shown = s;
+        });
+        if (shown != style()) detail::write_style(shown, style(), sink);
+        return out;
+    }
+
+    /* Text escaped for HTML, styled runs in <span style="...">. */
+    std::string html() const
+    {
+        std::string out;
+        out.reserve(this->plain.size() + this->runs.size() * 32);
+
+        this->visit([&out](std::string_view text, const style &s) {
+            std::string css = detail::css_of(s);
+            if (css.empty()) return detail::append_html_escaped(out, text);
+
+            out += "<span style=\"" + css + "\">";
+            detail::append_html_escaped(out, text);
+            out += "</span>";
+        });
+        return out;
+    }
+
+private:
+    std::string plain;
+    std::vector<span> runs;
+};
+
+} // namespace coltext
+
+#endif // COLTEXT_SPANS_HPP
@@ -0,0 +1,213 @@
+// Stress test of Coltext parsing with hostile markup.
+//
+// Usage: coltext-stress [--size bytes] [--verbose]
+//
+// Every pattern is parsed at size / 16 and size bytes in every mode.
+// Fails if time grows faster than input, if parser memory grows
+// with input, if escapes written break limits::max_expansion
+// or if effects are left open at the end.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "coltext.hpp"
+
+namespace stress {
+
+/* Bytes held by parsers, now and at most. */
+static std::size_t held = 0;
+static std::size_t peak = 0;
+
+template <class T>
+struct counting_allocator {
+    using value_type = T;
+
+    counting_allocator() = default;
+    template <class U> counting_allocator(const counting_allocator<U> &) noexcept {}
+
+    T * allocate(std::size_t n)
+    {
+        held += n * sizeof(T);
+        peak = std::max(peak, held);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept
+    {
+        held -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U> bool operator== (const counting_allocator<U> &) const noexcept { return true; }
+    template <class U> bool operator!= (const counting_allocator<U> &) const noexcept { return false; }
+};
+
+using parser = coltext::detail::basic_machine<counting_allocator<char>>;
+
+/* Sink dropping everything but the size and the style it ends with. */
+struct null_sink {
+    static constexpr bool effects = true;
+    std::size_t size = 0;
+    coltext::style shown;
+
+    void text(const char *s, std::size_t len)
+    {
+        size += len;
+
+        // Compact escapes are written whole, one at a time
+        if (coltext::detail::sgr_size(s, len) == len) coltext::detail::apply_sgr(s, len, shown);
+    }
+
+    void effect(const coltext::detail::code &c)
+    {
+        char esc[20];
+        size += coltext::detail::format_code(c, esc);
+        shown.apply(c);
+    }
+};
+
+struct pattern {
+    const char *name;
+    std::string head; // Written once
+    std::string body; // Repeated up to size
+};
+
+static std::vector<pattern> make_patterns()
+{
+    return {
+        {"deep_open",      "",                  "#r("},
+        {"deep_styles",    "",                  "<b>(<i>(<u>(#R("},
+        {"deep_rgb",       "",                  "#rgb[255;255;255](#RGB[255;255;255]("},
+        {"restore_rgb",    "#rgb[255;255;255](", "#r(x)"},
+        {"invalid_open",   "",                  "#x("},
+        {"invalid_nested", "",                  "#x(#r("},
+        {"long_tag",       "#",                 "a"},
+        {"unfinished",     "",                  "#aaaaaaaaaaaaaaaaaaaaaaa"},
+        {"backslashes",    "",                  "\\"},
+        {"closing",        "#r(",               ")"},
+        {"next_word",      "",                  "#r #g "},
+        {"closed_word",    "",                  "#r a) b #g(c "},
+        {"unknown_word",   "",                  "#zz a) b <u>(c "},
+        {"mixed",          "",                  "#r(<b>(\\#x(#G(a) b)#rgb[1;2;3] c "}
+    };
+}
+
+static std::string repeat(const pattern &p, std::size_t size)
+{
+    std::string str = p.head;
+    while (str.size() < size) str += p.body;
+    return str;
+}
+
+struct run_result {
+    double ns;
+    std::size_t output;
+    std::size_t peak;
+    bool closed; // Output ends with style reset
+};
+
+/* Parses text at once, the best time of a few runs. */
+static run_result run(const std::string &text, bool plain, bool compact, const coltext::limits &bounds)
+{
+    using clock = std::chrono::steady_clock;
+
+    run_result result{1e300, 0, 0, false};
+    for (int i = 0; i < 5; ++i)
+    {
+        peak = held;
+        std::size_t before = held;
+
+        auto start = clock::now();
+        null_sink sink;
+        parser m(compact, coltext::color_depth::truecolor, bounds);
+        coltext::detail::feed(m, text.data(), text.size(), sink, plain);
+        coltext::detail::finish(m, sink, plain);
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+        result.ns = std::min(result.ns, ns);
+        result.output = sink.size;
+        result.peak = peak - before;
+        result.closed = sink.shown == coltext::style();
+    }
+    return result;
+}
+
+struct mode {
+    const char *name;
+    bool plain, compact;
+};
+
+static int run_all(std::size_t size, bool verbose)
+{
+    const mode modes[] = {{"ansi", false, false}, {"compact", false, true}, {"plain", true, false}};
+    const std::size_t small = size / 16;
+
+    coltext::limits bounded = coltext::limits();
+    bounded.max_expansion = 4;
+
+    int failures = 0;
+    auto fail = [&](const char *what, const pattern &p, const mode &m) {
+        std::printf("FAIL %-16s %-8s %s\n", p.name, m.name, what);
+        ++failures;
+    };
+
+    for (const pattern &p : make_patterns())
+    {
+        std::string lhs = repeat(p, small);
+        std::string rhs = repeat(p, size);
+
+        for (const mode &m : modes)
+        {
+            run_result a = run(lhs, m.plain, m.compact, coltext::limits());
+            run_result b = run(rhs, m.plain, m.compact, coltext::limits());
+
+            double growth = b.ns / std::max(a.ns, 1.0) * (double)lhs.size() / (double)rhs.size();
+            if (verbose)
+            {
+                std::printf("%-16s %-8s %8.3f ns/B %6.2fx time %8zu bytes held\n", p.name, m.name,
+                            b.ns / (double)rhs.size(), growth, b.peak);
+            }
+
+            // 16 times more input may take up to 16 * 3 times longer
+            if (growth > 3) fail("time grows faster than input", p, m);
+            if (b.peak > a.peak) fail("memory grows with input", p, m);
+            if (!a.closed || !b.closed) fail("effects left open", p, m);
+
+            run_result c = run(rhs, m.plain, m.compact, bounded);
+            if (c.output > rhs.size() * (1 + bounded.max_expansion)) fail("escapes over max_expansion", p, m);
+            if (!c.closed) fail("effects left open over limits", p, m);
+
+            // Short markup too, as it's usually written
+            if (!run(p.head + p.body, m.plain, m.compact, coltext::limits()).closed) fail("effects left open", p, m);
+        }
+    }
+
+    std::printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
+
+} // namespace stress
+
+int main(int argc, char const *argv[])
+{
+    std::size_t size = 1 << 20;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strcmp(argv[i], "--size") && i + 1 < argc) size = (std::size_t)std::atoll(argv[++i]);
+        else if (!std::strcmp(argv[i], "--verbose")) verbose = true;
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--size bytes] [--verbose]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    return stress::run_all(size, verbose);
+}
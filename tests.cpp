@@ -1,9 +1,23 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #include "coltext.hpp"
+#include "coltext_async.hpp"
+#include "coltext_batch.hpp"
+#include "coltext_cache.hpp"
+#include "coltext_spans.hpp"
 
 namespace test {
 
+/* Tests that printed FAIL, returned by main so CTest sees them. */
+int failures = 0;
+
 void plain_text() 
 {
     std::cout << "Starting plain_text test:\n";
@@ -94,6 +108,29 @@ void color_next_word() {
     std::cout << "[ #g OK ] Test color_next_word succeded\n\n"_col; 
 }
 
+void closed_next_word()
+{
+    std::cout << "Starting closed_next_word test:\n";
+
+    // ')' ends the next word scope, so the space after it closes nothing
+    std::string msg = "#r a) b #g(c";
+    std::string colored = coltext::compiled_template(msg, coltext::render_mode::ansi).format();
+    std::string unknown = coltext::compiled_template("#zz a) b <u>(c", coltext::render_mode::ansi).format();
+    std::string compact = coltext::compiled_template("#zz a) b <u>(c", coltext::render_mode::ansi, true).format();
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << colored << "\n";
+
+    if (colored == "\033[31ma\033[39m b \033[32mc\033[39m" && 
+        unknown == "#zz a b \033[4mc\033[24m" && compact == "#zz a b \033[4mc\033[0m")
+        std::cout << "[ #g OK ] Test closed_next_word succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test closed_next_word failed\n\n"_col;
+    }
+}
+
 void literal()
 {
     std::cout << "Starting literal test:\n";
@@ -213,9 +250,609 @@ void rgb()
     std::cout << "[ #g OK ] Test rgb succeded\n\n"_col; 
 }
 
+#ifdef COLTEXT_STATIC_LITERALS
+// "text"_col must be parsed by the compiler, not be a Coltext
+static_assert(std::is_same_v<std::decay_t<decltype("#r(x)"_col)>, coltext::static_text<6, 12, 2, 11>>);
+static_assert(std::string_view("#r(x)"_col) == "\033[31mx\033[39m");
+#endif
+
+void static_literal()
+{
+    std::cout << "Starting static_literal test:\n";
+
+    std::string msg = "#C(You #r(can) use #rgb[0;255;255] literals <u>(at) compile time!)";
+    std::ostringstream runtime, literal;
+    runtime << Coltext(msg);
+    literal << "#C(You #r(can) use #rgb[0;255;255] literals <u>(at) compile time!)"_col;
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << literal.str() << "\n";
+
+    if (runtime.str() == literal.str())
+        std::cout << "[ #g OK ] Test static_literal succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test static_literal failed\n\n"_col;
+    }
+}
+
+void concatenation()
+{
+    std::cout << "Starting concatenation test:\n";
+
+    std::string msg = "#C(You #r(can) build #y lines piece by piece)";
+    Coltext ctxt;
+    for (size_t i = 0; i < msg.size(); i += 3) ctxt += Coltext(msg.substr(i, 3));
+
+    std::ostringstream whole, pieces;
+    whole  << Coltext(msg);
+    pieces << ctxt;
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << ctxt << "\n";
+
+    if (whole.str() == pieces.str())
+        std::cout << "[ #g OK ] Test concatenation succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test concatenation failed\n\n"_col;
+    }
+}
+
+void lazy()
+{
+    std::cout << "Starting lazy test:\n";
+
+    std::string msg = "#y(Lazy) text is #g rendered on first use";
+    Coltext ctxt(msg, coltext::lazy);
+
+    std::ostringstream eager, streamed;
+    eager    << Coltext(msg);
+    streamed << ctxt;
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << ctxt << "\n";
+
+    if (eager.str() == streamed.str() && eager.str() == ctxt.colored())
+        std::cout << "[ #g OK ] Test lazy succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test lazy failed\n\n"_col;
+    }
+}
+
+void stream()
+{
+    std::cout << "Starting stream test:\n";
+
+    std::string msg = "#C(Markup #r(is) parsed #y while <u> written \\#)";
+    std::ostringstream parsed, streamed;
+    coltext::set_render_mode(parsed, coltext::render_mode::ansi);
+    coltext::set_render_mode(streamed, coltext::render_mode::ansi);
+    parsed << Coltext(msg);
+    {
+        coltext::ostream out(streamed);
+        for (char c : msg) out << c << std::flush; // Every tag is split between parser calls
+    }
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << streamed.str() << "\n";
+
+    if (parsed.str() == streamed.str())
+        std::cout << "[ #g OK ] Test stream succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test stream failed\n\n"_col;
+    }
+}
+
+void parser()
+{
+    std::cout << "Starting parser test:\n";
+
+    std::string msg = "#r(Scope over\nlines <b>(in) #Y chunks \\(split\\)) anywhere";
+    coltext::compiled_template whole(msg, coltext::render_mode::ansi);
+
+    coltext::parser p(coltext::render_mode::ansi, false);
+    std::string chunked;
+    for (std::size_t i = 0; i < msg.size(); i += 3) chunked += p.feed(std::string_view(msg).substr(i, 3));
+    chunked += p.finish();
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << chunked << "\n";
+
+    if (chunked == whole.format() && p.neutral())
+        std::cout << "[ #g OK ] Test parser succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test parser failed\n\n"_col;
+    }
+}
+
+void plain_mode()
+{
+    std::cout << "Starting plain_mode test:\n";
+
+    std::string msg = "#r(No) #g escapes <b>(in) #RGB[0;0;255] plain \\#mode";
+    std::ostringstream os;
+    coltext::set_render_mode(os, coltext::render_mode::plain);
+    os << Coltext(msg) << "|" << "#r(No) #g escapes <b>(in) #RGB[0;0;255] plain \\#mode"_col;
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << os.str() << "\n";
+
+    if (os.str() == "No escapes in plain #mode|No escapes in plain #mode")
+        std::cout << "[ #g OK ] Test plain_mode succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test plain_mode failed\n\n"_col;
+    }
+}
+
+void compact_escapes()
+{
+    std::cout << "Starting compact_escapes test:\n";
+
+    std::string msg = "#bold(#r(#B(Compact))) #r(#r(escapes))";
+    std::ostringstream os;
+    coltext::set_compact_escapes(os, true);
+    os << Coltext(msg);
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << os.str() << "\n";
+
+    if (os.str() == "\033[1;31;44mCompact\033[0m \033[31mescapes\033[0m")
+        std::cout << "[ #g OK ] Test compact_escapes succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test compact_escapes failed\n\n"_col;
+    }
+}
+
+void allocator()
+{
+    std::cout << "Starting allocator test:\n";
+
+    std::string msg = "#r(Red <b>(and bold)) #G(#b(on green) <u>(background))";
+
+#ifdef __cpp_lib_memory_resource
+    char buffer[4096];
+    std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer), std::pmr::null_memory_resource());
+
+    coltext::pmr::Coltext ctxt(msg.c_str(), msg.size(), &arena);
+    ctxt = ctxt + coltext::pmr::Coltext("#c( in arena)", 13, &arena);
+    std::string colored(ctxt.colored().c_str(), ctxt.colored().size());
+
+    // Markup is freed to the resource it came from
+    std::pmr::unsynchronized_pool_resource pool;
+    coltext::pmr::Coltext lines(msg.c_str(), msg.size(), &pool);
+    lines.drop_source();
+    lines += coltext::pmr::Coltext(" #g(without markup)", 19, &pool).drop_source();
+    lines += coltext::pmr::Coltext(" #y(with markup)", 16, &pool);
+    std::string dropped(lines.colored().c_str(), lines.colored().size());
+#else
+    std::string colored = (Coltext(msg) + Coltext("#c( in arena)")).colored();
+    std::string dropped = (Coltext(msg) + Coltext(" #g(without markup)") + Coltext(" #y(with markup)")).colored();
+#endif
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << colored << "\n";
+
+    if (colored == (Coltext(msg) + Coltext("#c( in arena)")).colored() &&
+        dropped == (Coltext(msg) + Coltext(" #g(without markup)") + Coltext(" #y(with markup)")).colored())
+        std::cout << "[ #g OK ] Test allocator succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test allocator failed\n\n"_col;
+    }
+}
+
+void compiled_template()
+{
+    std::cout << "Starting compiled_template test:\n";
+
+    std::string msg = "#g(OK) #b({}) took #y({}) ms";
+    coltext::compiled_template done(msg);
+    std::string result = done.format("#r(not markup)", 42);
+
+    // Giving only render mode keeps global compact escapes
+    coltext::set_compact_escapes(true);
+    std::string compact = coltext::compiled_template("#r(a) <b>(b)", coltext::render_mode::ansi).format();
+    coltext::set_compact_escapes(false);
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << result << "\n";
+
+    if (result == "\033[32mOK\033[39m \033[34m#r(not markup)\033[39m took \033[33m42\033[39m ms" &&
+        compact == coltext::compiled_template("#r(a) <b>(b)", coltext::render_mode::ansi, true).format() &&
+        compact != coltext::compiled_template("#r(a) <b>(b)", coltext::render_mode::ansi, false).format())
+        std::cout << "[ #g OK ] Test compiled_template succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test compiled_template failed\n\n"_col;
+    }
+}
+
+void batch()
+{
+    std::cout << "Starting batch test:\n";
+
+    std::string msg = "#r(Each) line\n#b is <b>(parsed)\nalone #g(";
+    auto lines = coltext::render_lines(msg, {2});
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << lines.text << "\n";
+
+    if (lines.size() == 3 && lines[0] == Coltext("#r(Each) line").colored() &&
+        lines[1] == Coltext("#b is <b>(parsed)").colored() &&
+        lines[2] == Coltext("alone #g(").colored())
+        std::cout << "[ #g OK ] Test batch succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test batch failed\n\n"_col;
+    }
+}
+
+void cache()
+{
+    std::cout << "Starting cache test:\n";
+
+    std::string msg = "#g([ OK ]) #b(cached) <b>(status)";
+    coltext::render_cache cache;
+    Coltext first  = cache.get(msg);
+    Coltext second = cache.get(msg);
+    auto stats = cache.stats();
+
+    // Text rendered with other limits is not taken
+    coltext::limits bounds = coltext::get_limits();
+    coltext::set_limits({1, 17, 0});
+    bool limited = cache.get(msg).colored() == Coltext(msg).colored() && cache.stats().misses == 2;
+    coltext::set_limits(bounds);
+
+    // Limits changed by other thread while rendering, text is kept under the ones it has
+    coltext::limits small{1, 17, 0};
+    coltext::render_mode mode = coltext::get_render_mode();
+    coltext::set_render_mode(coltext::render_mode::ansi); // Limits change nothing in plain text
+    std::atomic<bool> done{false}, started{false};
+    std::thread flip([&] {
+        for (bool on = false; !done.load(); on = !on)
+        {
+            coltext::set_limits(on ? small : bounds);
+            started = true;
+        }
+    });
+    while (!started.load()) std::this_thread::yield();
+    coltext::render_cache flipped(16 << 20);
+    std::string nested = "#r(Red #g(too deep) red) ";
+    int count = 0; // Rendered for a while, so threads take turns on one core too
+    auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+    while (count < 20000 && std::chrono::steady_clock::now() < until) flipped.get(nested + std::to_string(count++));
+    done = true;
+    flip.join();
+
+    bool consistent = true;
+    for (const coltext::limits &l : {bounds, small})
+    {
+        coltext::set_limits(l);
+        for (int i = 0; i < count; ++i)
+        {
+            std::string m = nested + std::to_string(i);
+            consistent &= flipped.get(m).colored() == Coltext(m).colored();
+        }
+    }
+    coltext::set_limits(bounds);
+    coltext::set_render_mode(mode);
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << second << "\n";
+
+    if (second.colored() == Coltext(msg).colored() && first.colored() == second.colored() &&
+        stats.hits == 1 && stats.misses == 1 && stats.entries == 1 && limited && consistent)
+        std::cout << "[ #g OK ] Test cache succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test cache failed\n\n"_col;
+    }
+}
+
+void drop_source()
+{
+    std::cout << "Starting drop_source test:\n";
+
+    std::string msg = "#r(Only <b>(rendered)) text is kept";
+    Coltext ctxt = Coltext(std::string(msg)).drop_source() + Coltext(std::string_view(" #g(after)"));
+    Coltext copied = msg; // Lvalue std::string is copied, not moved
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << ctxt << "\n";
+
+    if (!ctxt.has_source() && ctxt.colored() == Coltext(msg + " #g(after)").colored() &&
+        copied.colored() == Coltext(std::string_view(msg)).colored() && !msg.empty())
+        std::cout << "[ #g OK ] Test drop_source succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test drop_source failed\n\n"_col;
+    }
+}
+
+void limits()
+{
+    std::cout << "Starting limits test:\n";
+
+    std::string msg = "#r(Red #g(too deep) <b>(too) red) #b(blue)";
+
+    coltext::limits old = coltext::get_limits();
+    coltext::set_limits({1, 17, 0});
+    Coltext ctxt(msg);
+    coltext::set_limits(old);
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << ctxt << "\n";
+
+    if (ctxt.colored() == Coltext("#r(Red too deep too red) #b(blue)").colored())
+        std::cout << "[ #g OK ] Test limits succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test limits failed\n\n"_col;
+    }
+}
+
+void downsampling()
+{
+    std::cout << "Starting downsampling test:\n";
+
+    std::string msg = "#rgb[255;135;0](Orange) on #RGB[0;0;139](dark blue)";
+
+    coltext::set_color_depth(coltext::color_depth::xterm256);
+    Coltext xterm256(msg);
+    coltext::set_color_depth(coltext::color_depth::ansi16);
+    Coltext ansi16(msg);
+    Coltext teal("#rgb[47;115;115](teal)"); // Nearer to bright black than to black
+    coltext::set_color_depth(coltext::color_depth::truecolor);
+
+    // Colors kept for the cell of rgb give the nearest of all 16, edges of cells are checked
+    std::vector<int> values;
+    for (int v = 0; v < 256; ++v) if (v % 5 == 0 || v % 32 < 2 || v % 32 > 29) values.push_back(v);
+
+    bool nearest = true;
+    for (int r : values) for (int g : values) for (int b : values)
+    {
+        int best = 0, best_distance = 1 << 30;
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char *c = coltext::detail::ansi16_colors[i];
+            int d = (r - c[0]) * (r - c[0]) + (g - c[1]) * (g - c[1]) + (b - c[2]) * (b - c[2]);
+            if (d < best_distance) { best = i; best_distance = d; }
+        }
+        nearest &= coltext::detail::to_ansi16((unsigned char)r, (unsigned char)g, (unsigned char)b) == best;
+    }
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << xterm256.colored() << "\n";
+    std::cout << "\t"  << ansi16.colored() << "\n";
+
+    if (xterm256.colored() == "\033[38;5;208mOrange\033[39m on \033[48;5;18mdark blue\033[49m" &&
+        ansi16.colored() == Coltext("#y(Orange) on #B(dark blue)").colored() &&
+        teal.colored() == "\033[90mteal\033[39m" && nearest)
+        std::cout << "[ #g OK ] Test downsampling succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test downsampling failed\n\n"_col;
+    }
+}
+
+void width()
+{
+    std::cout << "Starting width test:\n";
+
+    std::string msg = "#r(日本) <b>(text)";
+    Coltext padded = Coltext(msg).pad_to(12) + Coltext("|");
+    Coltext cut = Coltext(msg).truncate_to(7);
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << padded << "\n";
+    std::cout << "\t"  << cut << "\n";
+
+    if (Coltext(msg).width() == 9 && padded.width() == 13 && 
+        cut.width() == 7 && cut.colored() == Coltext("#r(日本) <b>(te)").colored())
+        std::cout << "[ #g OK ] Test width succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test width failed\n\n"_col;
+    }
+}
+
+void slice()
+{
+    std::cout << "Starting slice test:\n";
+
+    std::string msg = "#r(hello) <b>(wor#g(ld)) 日本";
+    Coltext line(msg);
+    Coltext part = line.slice(3, 8);
+    Coltext wide = line.slice(14, 3);
+
+    Coltext longer = line;
+    longer += Coltext(" #b(more)");
+
+    // Rendered Coltext is sliced and copied by many threads, the first slice makes the index
+    const Coltext shared(msg);
+    std::vector<std::string> parts(4);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < parts.size(); ++t)
+    {
+        threads.emplace_back([&, t] { 
+            parts[t] = t % 2 ? Coltext(shared).slice(3, 8).colored() : shared.slice(3, 8).colored(); 
+        });
+    }
+    for (auto &thread : threads) thread.join();
+
+    bool same = true;
+    for (const std::string &p : parts) same = same && p == part.colored();
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << part << "|" << wide << "|\n";
+
+    if (part.colored() == "\033[31mlo\033[0m \033[1mwor\033[32mld\033[0m" && part.width() == 8 &&
+        wide.colored() == "本" && line.slice(20).width() == 0 && 
+        longer.slice(17, 4).colored() == "\033[34mmore\033[0m" && same)
+        std::cout << "[ #g OK ] Test slice succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test slice failed\n\n"_col;
+    }
+}
+
+void spans()
+{
+    std::cout << "Starting spans test:\n";
+
+    std::string msg = "#r(Parsed) <b>(once) & shown";
+    coltext::styled_text text(msg);
+
+    std::cout << "\t"  << msg << "\n";
+    std::cout << "\t"  << text.ansi() << "\n";
+    std::cout << "\t"  << text.html() << "\n";
+
+    coltext::set_compact_escapes(true);
+    bool same = text.ansi() == Coltext(msg).colored();
+    coltext::set_compact_escapes(false);
+
+    // Spans are described by public coltext::style and coltext::color only
+    const coltext::style &red = text.spans()[0].style, &bold = text.spans()[2].style;
+    bool styled = red.fg == coltext::color{ansi::Effect::red_fg} && (bold.attrs & coltext::style::bold);
+
+    if (same && styled && text.text() == "Parsed once & shown" && text.spans().size() == 4 &&
+        text.html() == "<span style=\"color:#cd0000;\">Parsed</span> "
+                       "<span style=\"font-weight:bold;\">once</span> &amp; shown")
+        std::cout << "[ #g OK ] Test spans succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test spans failed\n\n"_col;
+    }
+}
+
+void async_log()
+{
+    std::cout << "Starting async_log test:\n";
+
+    std::string msg = "#r(Pushed) by <b>(threads)\n";
+    std::ostringstream os;
+    bool lines_ok = true;
+    std::uint64_t dropped = 1;
+
+    {
+        coltext::async_options options;
+        options.capacity = 8;
+        options.mode = coltext::render_mode::ansi;
+
+        coltext::compiled_template tmpl("#g({}) done\n", coltext::render_mode::ansi);
+        coltext::async_log log(os, options);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 250; ++i) log.push(msg);
+                log.push(tmpl, "task");
+            });
+        }
+        for (auto &thread : threads) thread.join();
+
+        log.flush();
+        dropped = log.dropped();
+    }
+
+    std::string line = Coltext(msg).colored(), done = Coltext("#g(task) done\n").colored();
+    std::string text = os.str();
+    std::size_t lines = 0, dones = 0;
+    for (std::size_t i = 0; i < text.size(); )
+    {
+        if      (text.compare(i, line.size(), line) == 0) { ++lines; i += line.size(); }
+        else if (text.compare(i, done.size(), done) == 0) { ++dones; i += done.size(); }
+        else { lines_ok = false; break; }
+    }
+
+    // Plain log writes templates compiled with escapes without them
+    std::ostringstream plain;
+    {
+        coltext::async_options options;
+        options.mode = coltext::render_mode::plain;
+
+        coltext::async_log log(plain, options);
+        log.push("#r(raw)\n");
+        log.push(coltext::compiled_template("#r(x) {}\n", coltext::render_mode::ansi), 1);
+    }
+
+    std::cout << "\t"  << msg;
+    std::cout << "\t"  << lines << " lines and " << dones << " templates written\n";
+
+    if (lines_ok && lines == 1000 && dones == 4 && dropped == 0 && plain.str() == "raw\nx 1\n")
+        std::cout << "[ #g OK ] Test async_log succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test async_log failed\n\n"_col;
+    }
+}
+
+void stats()
+{
+    std::cout << "Starting stats test:\n";
+
+    std::string msg = "#r(Counted) <b>(#g(nested tags)) #unknown(tag)";
+
+    static coltext::stats work;
+    coltext::set_stats_hook([](const coltext::stats &s) { work = s; });
+
+    coltext::stats before = coltext::get_stats();
+    coltext::compiled_template tmpl(msg, coltext::render_mode::ansi);
+    coltext::stats after = coltext::get_stats();
+    coltext::set_stats_hook(nullptr);
+
+    std::cout << "\t"  << tmpl.format() << "\n";
+    std::cout << "\t"  << work.bytes_parsed << " bytes parsed, " << work.bytes_written << " written, "
+              << work.tags_resolved << " tags, " << work.render_ns << " ns\n";
+
+#if defined(COLTEXT_STATS)
+    bool counted = after.bytes_parsed  - before.bytes_parsed  == msg.size() &&
+                   after.tags_resolved - before.tags_resolved == 3 &&
+                   after.tags_unknown  - before.tags_unknown  == 1 &&
+                   after.renders       - before.renders       == 1 &&
+                   work.bytes_written == tmpl.format().size() &&
+                   work.max_depth == 2 && work.renders == 1 && work.bytes_parsed == msg.size();
+#else
+    bool counted = before.renders == 0 && after.renders == 0 && after.bytes_parsed == 0 && work.renders == 0;
+#endif
+
+    if (counted)
+        std::cout << "[ #g OK ] Test stats succeded\n\n"_col;
+    else
+    {
+        ++failures;
+        std::cout << "[ #r FAIL ] Test stats failed\n\n"_col;
+    }
+}
+
 } // namespace test
 
-int main(int argc, char const *argv[])
+int main()
 {
     /* Tests for not breaking standard functionality */
     test::plain_text();
@@ -227,6 +864,7 @@ int main(int argc, char const *argv[])
     test::escaped_right_parenthese(); // Does #xxx((Text in patenthese\\)) work ?
 
     test::color_next_word();       // Does #xxx next_word other_words work ?
+    test::closed_next_word();      // Is everything closed after #xxx word) ?
     test::styles();                // Does #<html_tag> work ?
     test::literal();               // Does "text"_col work ?
 
@@ -238,6 +876,26 @@ int main(int argc, char const *argv[])
 
     test::rgb();                   // Do #rgb and #RGB work ?
 
+    test::static_literal();        // Is "text"_col the same at compile time ?
+    test::concatenation();         // Does += continue open effects ?
+    test::lazy();                  // Does lazy Coltext print the same ?
+    test::stream();                // Does coltext::ostream parse on the fly ?
+    test::parser();                // Do chunks render as one markup ?
+    test::plain_mode();            // Is markup removed without escapes ?
+    test::compact_escapes();       // Are escapes merged ?
+    test::allocator();             // Does pmr Coltext render the same ?
+    test::compiled_template();     // Are values spliced without parsing ?
+    test::batch();                 // Are lines rendered in order ?
+    test::cache();                 // Is repeated markup taken from cache ?
+    test::drop_source();           // Does Coltext work without markup ?
+    test::limits();                // Are tags over limits dropped ?
+    test::downsampling();          // Are rgb colors shown with 256 and 16 colors ?
+    test::width();                 // Are columns of text counted ?
+    test::slice();                 // Do slices keep style of their columns ?
+    test::spans();                 // Is parsed text rendered by every backend ?
+    test::async_log();             // Are lines of many threads written whole ?
+    test::stats();                 // Is work counted with COLTEXT_STATS ?
+
     test::get_from_cin();          // Does operator>> work ?
-    return 0;
+    return test::failures != 0;
 }